@@ -0,0 +1,397 @@
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <effolkronium/random.hpp>
+#include "ImageData.h"
+#include "debug.h"
+#include "geom.h"
+#include "io.h"
+#include "png.h"
+#include "util.h"
+
+// Per-stage timings on synthetic sprites. Every generator is seeded, so a case produces the same image on every run
+// and machine, and timings can be compared against a baseline saved earlier:
+//
+//   sprite-analyzer-bench --save baseline.txt
+//   sprite-analyzer-bench --baseline baseline.txt --tolerance 10
+//
+// The second form exits with an error when any stage got slower than the tolerance, in percent.
+
+struct BenchOptions {
+    int size = 2048;
+    uint32_t repeat = 5;
+    std::string filter;
+    std::string savePath;
+    std::string baselinePath;
+    double tolerance = 10.0;
+};
+
+struct StageResult {
+    std::string caseName;
+    std::string stage;
+    double seconds;
+    double units;
+    const char* unit;
+};
+
+using Random = effolkronium::random_local;
+
+void setOpaque(ImageData& image, int x, int y, uint8_t alpha = 255) {
+    if (x >= 0 && x < image.width && y >= 0 && y < image.height) {
+        image.rawData[(static_cast<size_t>(y) * image.width + x) * 4 + 3] = alpha;
+    }
+}
+
+void fillEllipse(ImageData& image, float centerX, float centerY, float rx, float ry) {
+    for (int y = static_cast<int>(centerY - ry); y <= static_cast<int>(centerY + ry); y++) {
+        for (int x = static_cast<int>(centerX - rx); x <= static_cast<int>(centerX + rx); x++) {
+            auto dx = (x - centerX) / rx;
+            auto dy = (y - centerY) / ry;
+
+            if (dx * dx + dy * dy <= 1.f) {
+                setOpaque(image, x, y);
+            }
+        }
+    }
+}
+
+// A grid of randomly sized opaque ellipses, one per cell.
+void makeBlobs(ImageData& image, Random& random) {
+    const int cellSize = 128;
+
+    for (int cy = 0; cy + cellSize <= image.height; cy += cellSize) {
+        for (int cx = 0; cx + cellSize <= image.width; cx += cellSize) {
+            auto rx = random.get(cellSize / 8.f, cellSize / 2.f - 1.f);
+            auto ry = random.get(cellSize / 8.f, cellSize / 2.f - 1.f);
+            fillEllipse(image, cx + cellSize / 2.f, cy + cellSize / 2.f, rx, ry);
+        }
+    }
+}
+
+// Random alpha on every pixel. With the threshold in the middle, about half the pixels form irregular clusters.
+void makeNoise(ImageData& image, Random& random) {
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
+            setOpaque(image, x, y, static_cast<uint8_t>(random.get(0, 255)));
+        }
+    }
+}
+
+// Particle sheet: one or two pixel dots on a 4 pixel grid.
+void makeDots(ImageData& image, Random& random) {
+    for (int y = 0; y < image.height; y += 4) {
+        for (int x = 0; x < image.width; x += 4) {
+            setOpaque(image, x, y);
+            if (random.get<bool>(0.3)) {
+                setOpaque(image, x + 1, y);
+            }
+        }
+    }
+}
+
+// One ellipse covering almost the whole image.
+void makeHuge(ImageData& image, Random&) {
+    fillEllipse(image, image.width / 2.f, image.height / 2.f, image.width / 2.f - 1.f, image.height / 2.f - 1.f);
+}
+
+// Thin diagonal strokes in both directions, two pixels wide so each one is still a single 4-connected shape. Crossing
+// strokes join up into long, sparse shapes with very few pixels per row.
+void makeStrokes(ImageData& image, Random& random) {
+    const int spacing = 32;
+
+    for (int start = -image.height; start < image.width; start += spacing) {
+        auto bRising = random.get<bool>();
+
+        for (int y = 0; y < image.height; y++) {
+            auto x = bRising ? start + y : start + image.height - y;
+            setOpaque(image, x, y);
+            setOpaque(image, x + 1, y);
+        }
+    }
+}
+
+struct BenchCase {
+    const char* name;
+    void (*generate)(ImageData&, Random&);
+    uint8_t alphaThreshold;
+};
+
+const BenchCase gCases[] {
+    { "blobs", makeBlobs, 0 },
+    { "noise", makeNoise, 127 },
+    { "dots", makeDots, 0 },
+    { "huge", makeHuge, 0 },
+    { "strokes", makeStrokes, 0 },
+};
+
+// Best of `repeat` runs, which is the least disturbed by everything else running on the machine.
+template<typename Fn>
+double measure(uint32_t repeat, Fn&& fn) {
+    auto best = std::numeric_limits<double>::max();
+
+    for (auto i = 0u; i < repeat; i++) {
+        auto start = std::chrono::steady_clock::now();
+        fn();
+        best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+
+    return best;
+}
+
+void runCase(const BenchCase& benchCase, const BenchOptions& options, std::vector<StageResult>& results) {
+    ImageData source;
+    source.width = options.size;
+    source.height = options.size;
+    source.rawData.assign(static_cast<size_t>(options.size) * options.size * 4, 0);
+
+    Random random;
+    random.seed(12345);
+    benchCase.generate(source, random);
+
+    auto filePath = (std::filesystem::temp_directory_path() / ("sprite-analyzer-bench-" +
+        std::string(benchCase.name) + ".png")).string();
+
+    if (!png::write(filePath.c_str(), source)) {
+        util::bail("Failed to write benchmark image");
+    }
+
+    io::FileData file;
+    if (!file.open(filePath.c_str())) {
+        util::bail("Failed to read benchmark image");
+    }
+
+    auto megapixels = options.size * static_cast<double>(options.size) / 1e6;
+
+    auto add = [&](const char* stage, double seconds, double units, const char* unit) {
+        results.push_back({ benchCase.name, stage, seconds, units, unit });
+    };
+
+    ImageData image;
+    add("png::read", measure(options.repeat, [&] {
+        image.rawData.clear();
+        if (!png::read(filePath.c_str(), image)) {
+            util::bail("Failed to decode benchmark image");
+        }
+    }), megapixels, "MP");
+
+    ImageData mask;
+    add("png::decodeMask", measure(options.repeat, [&] {
+        if (!png::decodeMask(file.data(), file.size(), mask, benchCase.alphaThreshold, false)) {
+            util::bail("Failed to decode benchmark image");
+        }
+    }), megapixels, "MP");
+
+    std::filesystem::remove(filePath);
+
+    image.buildOpacityMask(benchCase.alphaThreshold);
+
+    const auto maxShapes = std::numeric_limits<uint32_t>::max();
+    uint32_t numFlood = 0, numRuns = 0;
+
+    add("findShapes flood", measure(options.repeat, [&] {
+        numFlood = image.findShapes(maxShapes, labeling::Method::FloodFill);
+    }), megapixels, "MP");
+
+    add("findShapes runs", measure(options.repeat, [&] {
+        numRuns = image.findShapes(maxShapes, labeling::Method::Runs);
+    }), megapixels, "MP");
+
+    if (numFlood != numRuns) {
+        util::bail("Labeling methods disagree on shape count");
+    }
+
+    auto& shapes = image.shapes;
+    geom::PolygonSettings settings;
+    std::vector<std::vector<glm::ivec2>> candidates(shapes.size());
+    std::vector<std::vector<int>> hulls(shapes.size());
+    std::vector<std::vector<glm::vec2>> polygons(shapes.size());
+
+    add("findHullCandidates", measure(options.repeat, [&] {
+        for (auto i = 0u; i < shapes.size(); i++) {
+            candidates[i].clear();
+            geom::findHullCandidates(image, shapes[i], settings.candidates, candidates[i]);
+        }
+    }), shapes.size(), "shapes");
+
+    add("computeConvexHull", measure(options.repeat, [&] {
+        for (auto i = 0u; i < shapes.size(); i++) {
+            hulls[i].clear();
+            geom::computeConvexHull(candidates[i], hulls[i]);
+        }
+    }), shapes.size(), "shapes");
+
+    // The whole per-shape fit, candidates and hull included.
+    add("findEnclosingPolygon", measure(options.repeat, [&] {
+        for (auto i = 0u; i < shapes.size(); i++) {
+            polygons[i].clear();
+            geom::findEnclosingPolygon(image, shapes[i], settings, polygons[i]);
+        }
+    }), shapes.size(), "shapes");
+
+    // Coarse-to-fine on a grid of at most 256 cells per side, only differs from the above for shapes larger than that.
+    auto pyramidSettings = settings;
+    pyramidSettings.pyramidSize = 256;
+    std::vector<glm::vec2> pyramidPolygon;
+
+    add("findEnclosingPolygon pyramid", measure(options.repeat, [&] {
+        for (auto i = 0u; i < shapes.size(); i++) {
+            pyramidPolygon.clear();
+            geom::findEnclosingPolygon(image, shapes[i], pyramidSettings, pyramidPolygon);
+        }
+    }), shapes.size(), "shapes");
+
+    auto totalArea = 0.f;
+    add("getPolyArea", measure(options.repeat, [&] {
+        totalArea = 0.f;
+        for (auto& polygon : polygons) {
+            if (!polygon.empty()) {
+                totalArea += geom::getPolyArea(polygon);
+            }
+        }
+    }), shapes.size(), "shapes");
+
+    add("debug::drawPolygons", measure(options.repeat, [&] {
+        debug::drawPolygons(image, polygons);
+    }), shapes.size(), "shapes");
+
+    util::print(benchCase.name, ": ", options.size, "x", options.size, ", ", shapes.size(), " shapes, polygon area ",
+        totalArea);
+}
+
+// Lines of case, stage and seconds, separated by tabs.
+std::map<std::string, double> loadBaseline(const std::string& filePath) {
+    std::ifstream stream(filePath);
+    if (!stream) {
+        util::bail("Failed to read baseline file");
+    }
+
+    std::map<std::string, double> baseline;
+    std::string line;
+
+    while (std::getline(stream, line)) {
+        auto first = line.find('\t');
+        auto second = line.rfind('\t');
+        if (first == std::string::npos || first == second) {
+            continue;
+        }
+
+        baseline[line.substr(0, second)] = std::stod(line.substr(second + 1));
+    }
+
+    return baseline;
+}
+
+void saveBaseline(const std::string& filePath, const std::vector<StageResult>& results) {
+    std::ofstream stream(filePath);
+
+    for (auto& result : results) {
+        stream << result.caseName << '\t' << result.stage << '\t' << std::setprecision(9) << result.seconds << '\n';
+    }
+
+    if (!stream) {
+        util::bail("Failed to write baseline file");
+    }
+}
+
+void parseOptions(int argc, char** argv, BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+
+        if (arg == "-h" || arg == "--help") {
+            util::print("Usage: sprite-analyzer-bench [--size N] [--repeat N] [--case NAME] [--save FILE] "
+                "[--baseline FILE] [--tolerance PERCENT]");
+            util::bail("Cases: blobs, noise, dots, huge, strokes", 0);
+        }
+
+        if (i + 1 == argc) {
+            util::bail("Missing option value");
+        }
+
+        std::string value = argv[++i];
+
+        if (arg == "--size") {
+            options.size = std::stoi(value);
+        } else if (arg == "--repeat") {
+            options.repeat = std::stoul(value);
+        } else if (arg == "--case") {
+            options.filter = value;
+        } else if (arg == "--save") {
+            options.savePath = value;
+        } else if (arg == "--baseline") {
+            options.baselinePath = value;
+        } else if (arg == "--tolerance") {
+            options.tolerance = std::stod(value);
+        } else {
+            util::bail("Unknown option");
+        }
+    }
+
+    if (options.size < 16 || options.repeat == 0) {
+        util::bail("Invalid size or repeat count");
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    parseOptions(argc, argv, options);
+
+    std::map<std::string, double> baseline;
+    if (!options.baselinePath.empty()) {
+        baseline = loadBaseline(options.baselinePath);
+    }
+
+    std::vector<StageResult> results;
+
+    for (auto& benchCase : gCases) {
+        if (options.filter.empty() || options.filter == benchCase.name) {
+            runCase(benchCase, options, results);
+        }
+    }
+
+    if (results.empty()) {
+        util::bail("Unknown case");
+    }
+
+    auto regressions = 0;
+    std::ostringstream table;
+    table << std::fixed;
+
+    for (auto& result : results) {
+        table << std::left << std::setw(10) << result.caseName << std::setw(30) << result.stage << std::right
+            << std::setprecision(3) << std::setw(12) << result.seconds * 1e3 << " ms"
+            << std::setprecision(1) << std::setw(14) << result.units / result.seconds << " " << result.unit << "/s";
+
+        auto it = baseline.find(result.caseName + '\t' + result.stage);
+        if (it != baseline.end() && it->second > 0.0) {
+            auto change = (result.seconds / it->second - 1.0) * 100.0;
+            table << std::showpos << std::setw(10) << change << "%" << std::noshowpos;
+
+            if (change > options.tolerance) {
+                table << "  REGRESSION";
+                regressions++;
+            }
+        }
+
+        table << '\n';
+    }
+
+    std::cout << table.str();
+
+    if (!options.savePath.empty()) {
+        saveBaseline(options.savePath, results);
+    }
+
+    if (regressions > 0) {
+        util::printError(regressions, " stage(s) slower than the baseline by more than ", options.tolerance, "%");
+        return 1;
+    }
+
+    return 0;
+}
@@ -1,6 +1,20 @@
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <numeric>
 #include "debug.h"
 #include "ImageData.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Labeling scratch per thread. Images are labeled one after another on the workers, so after the first few images
+// these only grow for an image with more runs or components than any before it.
+thread_local labeling::RunLabeler gLabeler;
+thread_local std::vector<ImageShape> gComponents;
+thread_local std::vector<uint32_t> gShapeIDs;
+
 int ImageData::getIndex(int x, int y) const {
     if (x < 0 || x >= width || y < 0 || y >= height) {
         return -1;
@@ -9,13 +23,25 @@ int ImageData::getIndex(int x, int y) const {
     return y * width + x;
 }
 
-uint32_t ImageData::findShapes(uint8_t maxShapes) {
+uint32_t ImageData::findShapes(uint32_t maxShapes, labeling::Method method, labeling::Overflow overflow) {
     assert(maxShapes > 0);
 
+    if (method == labeling::Method::Runs) {
+        gLabeler.reset();
+        extractRuns(0, height, gLabeler);
+        return assignShapes(gLabeler, maxShapes, overflow);
+    }
+
     reset();
+    findShapesFloodFill(maxShapes, overflow);
+
+    return shapes.size();
+}
 
-    auto bLimited = false;
-    auto shapeCounter = 0;
+void ImageData::findShapesFloodFill(uint32_t maxShapes, labeling::Overflow overflow) {
+    // Every component gets its own ID while filling, the shape limit is applied afterwards.
+    auto& components = gComponents;
+    components.clear();
 
     auto inside = [&](auto x, auto y) {
         auto index = getIndex(x, y);
@@ -23,52 +49,458 @@ uint32_t ImageData::findShapes(uint8_t maxShapes) {
             return false;
         }
 
-        return (pixelShapeMap[index] == 0) && getAlpha(index) > 0;
+        return (pixelShapeMap[index] == 0) && isOpaque(x, y);
     };
 
     auto set = [&](auto x, auto y) {
-        auto index = getIndex(x, y);
-        pixelShapeMap[index] = shapeCounter;
-        shapes.back().bounds.expand(x, y);
+        auto& component = components.back();
+        pixelShapeMap[getIndex(x, y)] = component.id;
+        component.bounds.expand(x, y);
+        component.pixelCount++;
     };
 
-    auto pixelLength = width * height;
-    for (int i = 0; i < pixelLength; i++) {
-        if (getAlpha(i) > 0 && pixelShapeMap[i] == 0) {
-            auto seedX = i % width;
-            auto seedY = i / width;
-
-            if (shapeCounter == maxShapes) {
-                bLimited = true;
-            } else {
-                ++shapeCounter;
-                shapes.emplace_back(ImageShape(shapeCounter, seedX, seedY));
+    for (int seedY = 0; seedY < height; seedY++) {
+        for (int seedX = 0; seedX < width; seedX++) {
+            if (isOpaque(seedX, seedY) && pixelShapeMap[seedY * width + seedX] == 0) {
+                components.emplace_back(ImageShape(components.size() + 1, seedX, seedY));
+                geom::floodFill(seedX, seedY, inside, set);
             }
-
-            geom::floodFill(seedX, seedY, inside, set);
         }
     }
 
-    if (bLimited) {
-        for (int i = 0; i < pixelLength; i++) {
-            auto& shapeID = pixelShapeMap[i];
-            if (shapeID > 0) {
-                shapeID = 1;
+    if (!limitShapes(components, maxShapes, overflow, gShapeIDs)) {
+        return;
+    }
+
+    for (auto& shapeID : pixelShapeMap) {
+        shapeID = gShapeIDs[shapeID];
+    }
+}
+
+void ImageData::extractRuns(int beginY, int endY, labeling::RunLabeler& labeler) const {
+    auto numWords = (width + 63) / 64;
+
+    // Word of a row in this image's coordinates. Views are shifted into place and cut off at their right edge, so the
+    // bits past the end of the row are always zero.
+    auto getWord = [&](const uint64_t* row, int wordIndex) {
+        auto word = row[wordIndex] >> maskBitOffset;
+        if (maskBitOffset != 0 && ((wordIndex + 1) << 6) < maskBitOffset + width) {
+            word |= row[wordIndex + 1] << (64 - maskBitOffset);
+        }
+
+        auto remaining = width - (wordIndex << 6);
+        if (remaining < 64) {
+            word &= (1ull << remaining) - 1;
+        }
+
+        return word;
+    };
+
+    // Searching for a clear bit therefore always stops at the end of the row.
+    auto findNext = [&](const uint64_t* row, int x, uint64_t invert) {
+        auto wordIndex = x >> 6;
+        auto bits = (getWord(row, wordIndex) ^ invert) & (~0ull << (x & 63));
+
+        while (bits == 0) {
+            if (++wordIndex == numWords) {
+                return width;
             }
+
+            bits = getWord(row, wordIndex) ^ invert;
         }
 
-        auto& mainBounds = shapes[0].bounds;
+        return std::min(width, (wordIndex << 6) + std::countr_zero(bits));
+    };
+
+    for (int y = beginY; y < endY; y++) {
+        auto row = getMask() + static_cast<size_t>(y) * maskStride;
+        auto x = 0;
+
+        while (x < width) {
+            x = findNext(row, x, 0ull);
+            if (x == width) {
+                break;
+            }
 
-        for (int i = 1; i < shapes.size(); i++) {
-            mainBounds.expand(shapes[i].bounds);
+            auto x0 = x;
+            x = findNext(row, x, ~0ull);
+
+            labeler.addRun(y, x0, x - 1);
         }
+    }
+}
+
+uint32_t ImageData::assignShapes(labeling::RunLabeler& labeler, uint32_t maxShapes, labeling::Overflow overflow) {
+    assert(maxShapes > 0);
+
+    reset();
+
+    auto numFound = labeler.resolve();
+    if (numFound == 0) {
+        return 0;
+    }
+
+    auto& components = gComponents;
+    components.assign(numFound, ImageShape());
 
-        shapes.resize(1);
+    for (auto i = 0u; i < numFound; i++) {
+        components[i].id = i + 1;
+    }
+
+    for (auto& run : labeler.runs) {
+        auto& component = components[run.label - 1];
+        component.bounds.expand(run.x0, run.y);
+        component.bounds.expand(run.x1, run.y);
+        component.pixelCount += run.x1 - run.x0 + 1;
+    }
+
+    // The limit is resolved on the components, so the label map is written only once.
+    auto bRemapped = limitShapes(components, maxShapes, overflow, gShapeIDs);
+
+    for (auto& run : labeler.runs) {
+        auto shapeID = bRemapped ? gShapeIDs[run.label] : run.label;
+        if (shapeID != 0) {
+            std::fill_n(pixelShapeMap.data() + static_cast<size_t>(run.y) * width + run.x0, run.x1 - run.x0 + 1,
+                shapeID);
+        }
     }
 
     return shapes.size();
 }
 
+// Squared gap between two bounds, 0 when they overlap.
+int64_t getBoundsDistance(const geom::Bounds<int>& a, const geom::Bounds<int>& b) {
+    int64_t dx = std::max({ 0, a.min.x - b.max.x, b.min.x - a.max.x });
+    int64_t dy = std::max({ 0, a.min.y - b.max.y, b.min.y - a.max.y });
+    return dx * dx + dy * dy;
+}
+
+// Uniform grid over the bounds of the kept shapes, listing each shape in every cell its bounds overlap. Finding the
+// nearest shape searches rings of cells around the query until the cells left are further away than the best match,
+// so each dropped component only looks at the kept shapes around it.
+struct NearestShapeGrid {
+    const std::vector<geom::Bounds<int>>* bounds = nullptr;
+    geom::Bounds<int> extent;
+    int cellSize = 1;
+    glm::ivec2 cellCount;
+    // Cell i lists the shapes items[offsets[i]] to items[offsets[i + 1] - 1].
+    std::vector<uint32_t> offsets;
+    std::vector<uint32_t> items;
+
+    void build(const std::vector<geom::Bounds<int>>& shapeBounds) {
+        bounds = &shapeBounds;
+
+        for (auto& shape : shapeBounds) {
+            extent.expand(shape);
+        }
+
+        // Square cells with about one shape each.
+        auto width = static_cast<int64_t>(extent.max.x) - extent.min.x + 1;
+        auto height = static_cast<int64_t>(extent.max.y) - extent.min.y + 1;
+        cellSize = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(width) * height /
+            std::max<size_t>(shapeBounds.size(), 1)))));
+        cellCount = glm::ivec2(static_cast<int>((width - 1) / cellSize + 1),
+            static_cast<int>((height - 1) / cellSize + 1));
+
+        offsets.assign(static_cast<size_t>(cellCount.x) * cellCount.y + 1, 0);
+        for (auto& shape : shapeBounds) {
+            forEachCell(shape, [&](size_t cell) { offsets[cell + 1]++; });
+        }
+
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        items.resize(offsets.back());
+
+        auto next = offsets;
+        for (auto i = 0u; i < shapeBounds.size(); i++) {
+            forEachCell(shapeBounds[i], [&](size_t cell) { items[next[cell]++] = i; });
+        }
+    }
+
+    // Closest shape by getBoundsDistance, ties go to the lowest index.
+    uint32_t findNearest(const geom::Bounds<int>& query) const {
+        auto min = getCell(query.min);
+        auto max = getCell(query.max);
+        auto nearest = 0u;
+        auto nearestDistance = INT64_MAX;
+
+        auto visitCell = [&](int x, int y) {
+            auto cell = static_cast<size_t>(y) * cellCount.x + x;
+            for (auto i = offsets[cell]; i < offsets[cell + 1]; i++) {
+                auto shape = items[i];
+                auto distance = getBoundsDistance(query, (*bounds)[shape]);
+                if (distance < nearestDistance || (distance == nearestDistance && shape < nearest)) {
+                    nearest = shape;
+                    nearestDistance = distance;
+                }
+            }
+        };
+
+        auto visitRow = [&](int y, int x0, int x1) {
+            for (auto x = x0; x <= x1; x++) {
+                visitCell(x, y);
+            }
+        };
+
+        auto visitColumn = [&](int x, int y0, int y1) {
+            for (auto y = y0; y <= y1; y++) {
+                visitCell(x, y);
+            }
+        };
+
+        for (auto y = min.y; y <= max.y; y++) {
+            visitRow(y, min.x, max.x);
+        }
+
+        while (true) {
+            // Every shape not seen yet lies in the strips of the extent on either side of the visited cells. An equal
+            // distance there still wins on a lower index, so only a strictly closer match stops the search.
+            auto bDone = true;
+            auto checkStrip = [&](bool bUnvisited, int x0, int y0, int x1, int y1) {
+                if (bUnvisited) {
+                    geom::Bounds<int> strip(x0, y0);
+                    strip.expand(x1, y1);
+                    bDone = bDone && nearestDistance < getBoundsDistance(query, strip);
+                }
+            };
+
+            auto pixelMin = glm::ivec2(extent.min.x + min.x * cellSize, extent.min.y + min.y * cellSize);
+            auto pixelMax = glm::ivec2(extent.min.x + (max.x + 1) * cellSize - 1,
+                extent.min.y + (max.y + 1) * cellSize - 1);
+            checkStrip(min.x > 0, extent.min.x, extent.min.y, pixelMin.x - 1, extent.max.y);
+            checkStrip(max.x < cellCount.x - 1, pixelMax.x + 1, extent.min.y, extent.max.x, extent.max.y);
+            checkStrip(min.y > 0, pixelMin.x, extent.min.y, pixelMax.x, pixelMin.y - 1);
+            checkStrip(max.y < cellCount.y - 1, pixelMin.x, pixelMax.y + 1, pixelMax.x, extent.max.y);
+            if (bDone) {
+                return nearest;
+            }
+
+            // Grow the visited cells by one ring, clamped to the grid.
+            if (min.y > 0) {
+                visitRow(--min.y, min.x, max.x);
+            }
+            if (max.y < cellCount.y - 1) {
+                visitRow(++max.y, min.x, max.x);
+            }
+            if (min.x > 0) {
+                visitColumn(--min.x, min.y, max.y);
+            }
+            if (max.x < cellCount.x - 1) {
+                visitColumn(++max.x, min.y, max.y);
+            }
+        }
+    }
+
+private:
+    // Clamped, so bounds reaching outside the grid start from its border cells.
+    glm::ivec2 getCell(const glm::ivec2& point) const {
+        return glm::ivec2(std::clamp((point.x - extent.min.x) / cellSize, 0, cellCount.x - 1),
+            std::clamp((point.y - extent.min.y) / cellSize, 0, cellCount.y - 1));
+    }
+
+    template<typename Fn>
+    void forEachCell(const geom::Bounds<int>& shape, Fn&& fn) const {
+        auto min = getCell(shape.min);
+        auto max = getCell(shape.max);
+
+        for (auto y = min.y; y <= max.y; y++) {
+            for (auto x = min.x; x <= max.x; x++) {
+                fn(static_cast<size_t>(y) * cellCount.x + x);
+            }
+        }
+    }
+};
+
+bool ImageData::limitShapes(std::vector<ImageShape>& components, uint32_t maxShapes, labeling::Overflow overflow,
+    std::vector<uint32_t>& outShapeIDs) {
+
+    if (components.size() <= maxShapes) {
+        // Swapped rather than moved, so the capacity of both keeps circulating.
+        shapes.swap(components);
+        return false;
+    }
+
+    outShapeIDs.assign(components.size() + 1, 0);
+
+    if (overflow == labeling::Overflow::Merge) {
+        shapes.assign(1, ImageShape());
+
+        auto& merged = shapes[0];
+        merged.id = 1;
+        merged.bMerged = true;
+
+        for (auto& component : components) {
+            merged.bounds.expand(component.bounds);
+            merged.pixelCount += component.pixelCount;
+            outShapeIDs[component.id] = 1;
+        }
+
+        return true;
+    }
+
+    // Largest components first, ties go to the one found first. The kept ones stay in raster order.
+    std::vector<uint32_t> order(components.size());
+    std::iota(order.begin(), order.end(), 0u);
+
+    std::nth_element(order.begin(), order.begin() + maxShapes, order.end(), [&](auto a, auto b) {
+        auto countA = components[a].pixelCount;
+        auto countB = components[b].pixelCount;
+        return countA > countB || (countA == countB && a < b);
+    });
+    std::sort(order.begin(), order.begin() + maxShapes);
+
+    shapes.clear();
+    shapes.reserve(maxShapes);
+
+    for (auto i = 0u; i < maxShapes; i++) {
+        auto& component = components[order[i]];
+        outShapeIDs[component.id] = i + 1;
+        shapes.push_back(component);
+        shapes.back().id = i + 1;
+    }
+
+    if (overflow == labeling::Overflow::Nearest) {
+        // Measured against the kept components' own bounds, so the result doesn't depend on the merge order.
+        std::vector<geom::Bounds<int>> keptBounds;
+        keptBounds.reserve(maxShapes);
+        for (auto i = 0u; i < maxShapes; i++) {
+            keptBounds.push_back(components[order[i]].bounds);
+        }
+
+        NearestShapeGrid grid;
+        grid.build(keptBounds);
+
+        for (auto i = maxShapes; i < order.size(); i++) {
+            auto& component = components[order[i]];
+            auto nearest = grid.findNearest(component.bounds);
+
+            auto& shape = shapes[nearest];
+            shape.bounds.expand(component.bounds);
+            shape.pixelCount += component.pixelCount;
+            shape.bMerged = true;
+            outShapeIDs[component.id] = nearest + 1;
+        }
+    }
+
+    return true;
+}
+
+ImageData ImageData::createView(int x, int y, int viewWidth, int viewHeight) const {
+    assert(x >= 0 && y >= 0 && x + viewWidth <= width && y + viewHeight <= height);
+
+    auto bit = maskBitOffset + x;
+
+    ImageData view;
+    view.width = viewWidth;
+    view.height = viewHeight;
+    view.maskStride = maskStride;
+    view.maskView = getMask() + static_cast<size_t>(y) * maskStride + (bit >> 6);
+    view.maskBitOffset = bit & 63;
+
+    return view;
+}
+
+void ImageData::resetOpacityMask() {
+    maskStride = (width + 63) / 64;
+    opacityMask.assign(static_cast<size_t>(maskStride) * height, 0ull);
+}
+
+void ImageData::buildOpacityMask(uint8_t alphaThreshold) {
+    buildOpacityMask(rawData.data(), static_cast<size_t>(width) * 4, 4, 3, alphaThreshold);
+}
+
+void ImageData::buildOpacityMask(const uint8_t* pixels, size_t stride, int pixelSize, int alphaOffset,
+    uint8_t alphaThreshold) {
+
+    resetOpacityMask();
+
+    if (alphaThreshold == 255) {
+        return;
+    }
+
+    for (int y = 0; y < height; y++) {
+        auto rowPixels = pixels + static_cast<size_t>(y) * stride;
+        auto alphas = rowPixels + alphaOffset;
+        auto row = getOpacityMaskRow(y);
+        auto x = 0;
+
+#if defined(__SSE2__)
+        // 16 pixels per step: move alpha into the low byte of each lane, pack down to bytes and compare unsigned.
+        auto minAlpha = _mm_set1_epi8(static_cast<char>(alphaThreshold + 1));
+
+        if (pixelSize == 4) {
+            auto shift = _mm_cvtsi32_si128(alphaOffset * 8);
+            auto lowByte = _mm_set1_epi32(0xFF);
+
+            for (; x + 16 <= width; x += 16) {
+                auto src = reinterpret_cast<const __m128i*>(rowPixels + x * 4);
+                auto a0 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(src + 0), shift), lowByte);
+                auto a1 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(src + 1), shift), lowByte);
+                auto a2 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(src + 2), shift), lowByte);
+                auto a3 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(src + 3), shift), lowByte);
+                auto alpha = _mm_packus_epi16(_mm_packs_epi32(a0, a1), _mm_packs_epi32(a2, a3));
+                auto opaque = _mm_cmpeq_epi8(_mm_max_epu8(alpha, minAlpha), alpha);
+                auto bits = static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(opaque)));
+                row[x >> 6] |= bits << (x & 63);
+            }
+        } else if (pixelSize == 1) {
+            for (; x + 16 <= width; x += 16) {
+                auto alpha = _mm_loadu_si128(reinterpret_cast<const __m128i*>(alphas + x));
+                auto opaque = _mm_cmpeq_epi8(_mm_max_epu8(alpha, minAlpha), alpha);
+                auto bits = static_cast<uint64_t>(static_cast<uint16_t>(_mm_movemask_epi8(opaque)));
+                row[x >> 6] |= bits << (x & 63);
+            }
+        }
+#endif
+
+        for (; x < width; x++) {
+            if (alphas[static_cast<size_t>(x) * pixelSize] > alphaThreshold) {
+                row[x >> 6] |= 1ull << (x & 63);
+            }
+        }
+    }
+}
+
+uint64_t ImageData::hashOpacityMask() const {
+    assert(maskView == nullptr);
+
+    // Multiply-xorshift mixing per word, four independent lanes so the multiplications overlap.
+    const uint64_t gMultiplier = 0x9E3779B97F4A7C15ull;
+
+    auto mix = [](uint64_t hash, uint64_t value) {
+        hash ^= value * 0xBF58476D1CE4E5B9ull;
+        return (hash ^ (hash >> 31)) * 0x94D049BB133111EBull;
+    };
+
+    uint64_t lanes[4] {
+        static_cast<uint64_t>(width),
+        static_cast<uint64_t>(height),
+        gMultiplier,
+        gMultiplier * 3
+    };
+
+    auto words = opacityMask.data();
+    auto count = opacityMask.size();
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        lanes[0] = mix(lanes[0], words[i + 0]);
+        lanes[1] = mix(lanes[1], words[i + 1]);
+        lanes[2] = mix(lanes[2], words[i + 2]);
+        lanes[3] = mix(lanes[3], words[i + 3]);
+    }
+
+    for (; i < count; i++) {
+        lanes[0] = mix(lanes[0], words[i]);
+    }
+
+    auto hash = mix(mix(mix(lanes[0], lanes[1]), lanes[2]), lanes[3]);
+    return mix(hash, count);
+}
+
+void ImageData::releasePixelData() {
+    std::vector<uint8_t>().swap(rawData);
+}
+
 uint8_t ImageData::getAlpha(int index) const {
     return rawData[index * 4 + 3];
 }
@@ -86,16 +518,18 @@ uint32_t ImageData::getPixelData(int index) {
 }
 
 void ImageData::reset() {
-    auto pixelCount = width * height;
-    pixelShapeMap.resize(pixelCount);
-    std::memset(pixelShapeMap.data(), 0, pixelCount);
+    pixelShapeMap.assign(static_cast<size_t>(width) * height, 0u);
     shapes.clear();
 }
 
-uint8_t ImageData::getShapeID(int index) const {
+uint32_t ImageData::getShapeID(int index) const {
     if (index < 0) {
         return 0;
     }
 
     return pixelShapeMap[index];
 }
+
+const uint32_t* ImageData::getShapeRow(int y) const {
+    return pixelShapeMap.data() + static_cast<size_t>(y) * width;
+}
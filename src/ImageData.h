@@ -5,17 +5,21 @@
 #include <vector>
 #include <glm/vec2.hpp>
 #include "geom.h"
+#include "labeling.h"
 
 struct ImageShape {
-    uint8_t id;
+    uint32_t id;
     geom::Bounds<int> bounds;
+    uint32_t pixelCount;
+    // Set when several disconnected components were combined into this shape because of the shape limit.
+    bool bMerged;
 
     ImageShape()
-        :id(0), bounds() {
+        :id(0), bounds(), pixelCount(0), bMerged(false) {
     }
 
-    ImageShape(uint8_t id, int x, int y)
-        :id(id), bounds(x, y) {
+    ImageShape(uint32_t id, int x, int y)
+        :id(id), bounds(x, y), pixelCount(0), bMerged(false) {
     }
 };
 
@@ -27,17 +31,77 @@ public:
     int height = 0;
 
 private:
-    std::vector<uint8_t> pixelShapeMap;
+    // Shape ID per pixel, 0 for pixels that aren't part of any shape.
+    std::vector<uint32_t> pixelShapeMap;
+
+    // One bit per pixel, set for pixels whose alpha is above the threshold. Rows are padded to whole words and the
+    // padding bits are always zero.
+    std::vector<uint64_t> opacityMask;
+    int maskStride = 0;
+
+    // Views point into another image's mask instead, starting `maskBitOffset` bits into their first word of each row.
+    // Bits past a view's right edge belong to the neighbouring pixels.
+    const uint64_t* maskView = nullptr;
+    int maskBitOffset = 0;
 
 public:
-    uint32_t findShapes(uint8_t maxShapes);
+    // Must be called after the pixel data is loaded; all shape analysis runs on the mask.
+    void buildOpacityMask(uint8_t alphaThreshold = 0);
+
+    // Builds the mask from pixels the image doesn't own, without copying them: rows are `stride` bytes apart and each
+    // pixel has `pixelSize` bytes with its alpha at `alphaOffset`. Width and height have to be set already.
+    void buildOpacityMask(const uint8_t* pixels, size_t stride, int pixelSize, int alphaOffset,
+        uint8_t alphaThreshold = 0);
+
+    // Clears the mask to the current size, for decoders that fill it row by row without any pixel data.
+    void resetOpacityMask();
+
+    uint64_t* getOpacityMaskRow(int y) {
+        return opacityMask.data() + static_cast<size_t>(y) * maskStride;
+    }
+
+    // Fast 64-bit hash of the mask and its dimensions; equal masks always produce equal shapes. Not for views.
+    uint64_t hashOpacityMask() const;
+
+    // Frees the RGBA pixel data once the mask is built and nothing is going to be drawn.
+    void releasePixelData();
+
+    // A cell of this image sharing its opacity mask, without copying. Shapes found in the view and all coordinates are
+    // relative to the cell. Views have no pixel data, and the mask has to outlive them.
+    ImageData createView(int x, int y, int viewWidth, int viewHeight) const;
+
+    bool isOpaque(int x, int y) const {
+        auto bit = x + maskBitOffset;
+        return (getMask()[static_cast<size_t>(y) * maskStride + (bit >> 6)] >> (bit & 63)) & 1u;
+    }
+
+    uint32_t findShapes(uint32_t maxShapes, labeling::Method method = labeling::Method::Runs,
+        labeling::Overflow overflow = labeling::Overflow::Merge);
+
+    // Split form of the run based labeling, so bands of rows can be labeled concurrently and stitched afterwards.
+    void extractRuns(int beginY, int endY, labeling::RunLabeler& labeler) const;
+    uint32_t assignShapes(labeling::RunLabeler& labeler, uint32_t maxShapes,
+        labeling::Overflow overflow = labeling::Overflow::Merge);
+
     int getIndex(int x, int y) const;
-    uint8_t getShapeID(int index) const;
+    uint32_t getShapeID(int index) const;
+    const uint32_t* getShapeRow(int y) const;
     uint8_t getAlpha(int index) const;
 
     void setPixelData(int index, uint32_t value);
     uint32_t getPixelData(int index);
 
 private:
+    const uint64_t* getMask() const {
+        return maskView ? maskView : opacityMask.data();
+    }
+
     void reset();
+    void findShapesFloodFill(uint32_t maxShapes, labeling::Overflow overflow);
+
+    // Turns the connected components into `shapes` according to the overflow policy. Returns false when every
+    // component became a shape with the same ID, otherwise `outShapeIDs` maps component IDs to shape IDs, where 0
+    // drops the component.
+    bool limitShapes(std::vector<ImageShape>& components, uint32_t maxShapes, labeling::Overflow overflow,
+        std::vector<uint32_t>& outShapeIDs);
 };
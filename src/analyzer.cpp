@@ -0,0 +1,82 @@
+#include "analyzer.h"
+#include "ImageData.h"
+
+// Mask, label and search buffers per thread, so only the first image a thread analyzes allocates them.
+thread_local ImageData gAnalyzerImage;
+thread_local geom::PolygonSearch gAnalyzerSearch;
+
+bool getPixelLayout(analyzer::PixelFormat format, int& outPixelSize, int& outAlphaOffset) {
+    switch (format) {
+        case analyzer::PixelFormat::RGBA8: outPixelSize = 4; outAlphaOffset = 3; return true;
+        case analyzer::PixelFormat::BGRA8: outPixelSize = 4; outAlphaOffset = 3; return true;
+        case analyzer::PixelFormat::ARGB8: outPixelSize = 4; outAlphaOffset = 0; return true;
+        case analyzer::PixelFormat::ABGR8: outPixelSize = 4; outAlphaOffset = 0; return true;
+        case analyzer::PixelFormat::A8: outPixelSize = 1; outAlphaOffset = 0; return true;
+    }
+
+    return false;
+}
+
+// Same limits as the command line options.
+bool isValid(const analyzer::Settings& settings) {
+    auto& polygonSettings = settings.polygonSettings;
+
+    return polygonSettings.quality <= 9 && polygonSettings.vertexCount >= 3 &&
+        polygonSettings.vertexCount <= geom::gMaxPolygonVertices &&
+        (polygonSettings.pyramidSize == 0 || polygonSettings.pyramidSize >= 8) && polygonSettings.areaEpsilon >= 0.f &&
+        settings.maxShapes > 0 && settings.alphaThreshold < 255;
+}
+
+bool analyzer::analyze(const ImageView& image, const Settings& settings, Result& outResult) {
+    outResult.shapes.clear();
+
+    int pixelSize, alphaOffset;
+    if (!getPixelLayout(image.format, pixelSize, alphaOffset) || !isValid(settings)) {
+        return false;
+    }
+
+    // Same side limits as for PNG files. The caller already holds the pixels, so their total isn't limited.
+    if (!image.pixels || image.width == 0 || image.height == 0 || image.width >= (1u << 30) ||
+        image.height >= (1u << 30) || image.stride < static_cast<size_t>(image.width) * pixelSize) {
+        return false;
+    }
+
+    auto& data = gAnalyzerImage;
+    data.width = static_cast<int>(image.width);
+    data.height = static_cast<int>(image.height);
+    data.buildOpacityMask(image.pixels, image.stride, pixelSize, alphaOffset, settings.alphaThreshold);
+    data.findShapes(settings.maxShapes, settings.labelingMethod, settings.overflow);
+
+    outResult.shapes.resize(data.shapes.size());
+
+    for (auto i = 0u; i < data.shapes.size(); i++) {
+        auto& object = data.shapes[i];
+        auto& shape = outResult.shapes[i];
+
+        shape.x = object.bounds.min.x;
+        shape.y = object.bounds.min.y;
+        shape.width = object.bounds.getWidth();
+        shape.height = object.bounds.getHeight();
+        shape.pixelCount = object.pixelCount;
+        shape.bMerged = object.bMerged;
+        shape.area = 0.f;
+        shape.iterations = 0;
+
+        // geom::findEnclosingPolygon would hide the iteration count, so the search is run here the same way.
+        auto& search = gAnalyzerSearch;
+        geom::beginPolygonSearch(data, object, settings.polygonSettings, search);
+
+        for (auto chunk = 0u; chunk < geom::getPolygonSearchChunks(search); chunk++) {
+            geom::runPolygonSearch(search, chunk);
+        }
+
+        if (geom::endPolygonSearch(search, shape.hull)) {
+            shape.area = geom::getPolyArea(shape.hull);
+            shape.iterations = geom::getPolygonSearchIterations(search);
+        } else {
+            shape.hull.clear();
+        }
+    }
+
+    return true;
+}
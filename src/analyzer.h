@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <glm/vec2.hpp>
+#include "geom.h"
+#include "labeling.h"
+
+// In-process entry point of the static library, for callers that already have decoded pixels. Runs on the calling
+// thread; any number of threads can analyze at once, each reusing its own buffers from one image to the next.
+namespace analyzer {
+    // Byte order of a pixel in memory.
+    enum class PixelFormat {
+        RGBA8,
+        BGRA8,
+        ARGB8,
+        ABGR8,
+        // Alpha only, one byte per pixel.
+        A8
+    };
+
+    // Pixels owned by the caller. They are only read while analyze() runs and are never copied; rows are `stride`
+    // bytes apart, which may be more than the width takes.
+    struct ImageView {
+        const uint8_t* pixels = nullptr;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        size_t stride = 0;
+        PixelFormat format = PixelFormat::RGBA8;
+    };
+
+    // Defaults match those of the command line.
+    struct Settings {
+        geom::PolygonSettings polygonSettings;
+        uint32_t maxShapes = 255;
+        labeling::Method labelingMethod = labeling::Method::Runs;
+        labeling::Overflow overflow = labeling::Overflow::Merge;
+        // Pixels with alpha above this value are opaque. (0-254)
+        uint8_t alphaThreshold = 0;
+    };
+
+    struct Shape {
+        // Bounding box of the shape's pixels relative to the view, measured as in the JSON output.
+        int x = 0;
+        int y = 0;
+        int width = 0;
+        int height = 0;
+        uint32_t pixelCount = 0;
+        // Set when components were combined into this shape because of the shape limit.
+        bool bMerged = false;
+        // Enclosing polygon, empty when none could be fitted.
+        std::vector<glm::vec2> hull;
+        float area = 0.f;
+        // Random search iterations used for the polygon.
+        uint32_t iterations = 0;
+    };
+
+    struct Result {
+        std::vector<Shape> shapes;
+    };
+
+    // Returns false when the view or the settings are invalid. `outResult` is overwritten, so passing the same one
+    // again reuses its vectors.
+    bool analyze(const ImageView& image, const Settings& settings, Result& outResult);
+}
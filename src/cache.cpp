@@ -0,0 +1,100 @@
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <chrono>
+#include "cache.h"
+
+#ifndef SPRITE_ANALYZER_VERSION
+#define SPRITE_ANALYZER_VERSION "dev"
+#endif
+
+// Bump when results change without a version change, e.g. between releases.
+const uint32_t gCacheRevision = 1;
+
+std::string cache::getVersionedKey(const std::string& key) {
+    return "sprite-analyzer " SPRITE_ANALYZER_VERSION " r" + std::to_string(gCacheRevision) + " " + key;
+}
+
+uint64_t cache::hash(const void* data, size_t size, uint64_t seed) {
+    // FNV-1a, only used on the short keys; the pixel data is hashed by ImageData.
+    auto bytes = static_cast<const uint8_t*>(data);
+    auto value = 0xCBF29CE484222325ull ^ seed;
+
+    for (size_t i = 0; i < size; i++) {
+        value = (value ^ bytes[i]) * 0x100000001B3ull;
+    }
+
+    return value;
+}
+
+bool cache::Store::open(const std::string& directory) {
+    std::error_code error;
+    std::filesystem::create_directories(directory, error);
+
+    this->directory = directory;
+    return std::filesystem::is_directory(directory, error);
+}
+
+std::string cache::Store::getPath(const std::string& versionedKey) const {
+    auto value = hash(versionedKey.data(), versionedKey.size());
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "%016llx.json", static_cast<unsigned long long>(value));
+
+    return (std::filesystem::path(directory) / name).string();
+}
+
+bool cache::Store::load(const std::string& key, std::string& outValue) {
+    auto versionedKey = getVersionedKey(key);
+    std::ifstream stream(getPath(versionedKey), std::ios::binary);
+
+    // The first line holds the full key, so keys whose file names collide don't return each other's results. It only
+    // guards the file name hash: keys made from the mask hash still match for different masks with equal hashes.
+    std::string storedKey;
+    if (stream && std::getline(stream, storedKey) && storedKey == versionedKey) {
+        std::ostringstream value;
+        value << stream.rdbuf();
+        outValue = value.str();
+
+        hits++;
+        return true;
+    }
+
+    misses++;
+    return false;
+}
+
+void cache::Store::rejectHit() {
+    hits--;
+    misses++;
+}
+
+void cache::Store::store(const std::string& key, const std::string& value) {
+    auto versionedKey = getVersionedKey(key);
+    auto path = getPath(versionedKey);
+
+    // Unique between threads and, through the time stamp, between processes sharing the directory.
+    std::ostringstream tmpPath;
+    tmpPath << path << ".tmp" << std::this_thread::get_id() << "-"
+        << std::chrono::steady_clock::now().time_since_epoch().count();
+
+    auto bWritten = false;
+    {
+        std::ofstream stream(tmpPath.str(), std::ios::binary | std::ios::trunc);
+        stream << versionedKey << '\n' << value;
+        stream.close();
+        bWritten = !stream.fail();
+    }
+
+    std::error_code error;
+    if (bWritten) {
+        std::filesystem::rename(tmpPath.str(), path, error);
+    }
+
+    // A partly written file would otherwise stay in the directory for good.
+    if (!bWritten || error) {
+        std::filesystem::remove(tmpPath.str(), error);
+    }
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <atomic>
+
+namespace cache {
+    uint64_t hash(const void* data, size_t size, uint64_t seed = 0);
+
+    // Prefixes the tool version, for anything persisted that has to be invalidated by a new build.
+    std::string getVersionedKey(const std::string& key);
+
+    // On-disk store of analysis results, addressed by a key describing everything the result depends on. The tool
+    // version is part of every key, so results of older builds are never returned.
+    class Store {
+    private:
+        std::string directory;
+        std::atomic<uint32_t> hits = 0;
+        std::atomic<uint32_t> misses = 0;
+
+    public:
+        // Creates the directory if needed.
+        bool open(const std::string& directory);
+
+        bool load(const std::string& key, std::string& outValue);
+        // Counts the last load() as a miss instead of a hit, for an entry that turned out to be unusable. Storing the
+        // key again overwrites it.
+        void rejectHit();
+
+        // Entries are written to a temporary file and renamed, so concurrent runs never see partial results.
+        void store(const std::string& key, const std::string& value);
+
+        uint32_t getHits() const {
+            return hits;
+        }
+
+        uint32_t getMisses() const {
+            return misses;
+        }
+
+    private:
+        std::string getPath(const std::string& versionedKey) const;
+    };
+}
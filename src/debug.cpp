@@ -1,7 +1,17 @@
 #include <glm/vec4.hpp>
+#include <glm/geometric.hpp>
 #include <numeric>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <thread>
+#include "analyzer.h"
 #include "geom.h"
 #include "png.h"
+#include "polyfile.h"
+#include "util.h"
 #include "debug.h"
 
 std::vector<glm::vec2> gCrossPixels {
@@ -29,34 +39,117 @@ uint32_t vec2uint(glm::vec4 value) {
     return r << 24 | g << 16 | b << 8 | a;
 }
 
-void debug::drawPolygon(ImageData& image, std::vector<glm::vec2>& vertices, glm::vec4 color) {
-    if (vertices.size() < 3) {
-        return;
+// Per byte average of two packed pixels, rounding down.
+inline uint32_t blendHalf(uint32_t a, uint32_t b) {
+    return (a & b) + (((a ^ b) & 0xFEFEFEFEu) >> 1);
+}
+
+void debug::drawPolygons(ImageData& image, const std::vector<std::vector<glm::vec2>>& polygons, glm::vec4 color) {
+    // An edge between two consecutive vertices, in the order geom::isInsidePoly visits them, so the crossings below
+    // are bit for bit the ones it computes.
+    struct Edge {
+        glm::vec2 a;
+        glm::vec2 b;
+        uint32_t polygon;
+        int firstRow;
+        int lastRow;
+    };
+
+    struct Crossing {
+        uint32_t polygon;
+        float x;
+    };
+
+    thread_local std::vector<Edge> gEdges;
+    thread_local std::vector<const Edge*> gActiveEdges;
+    thread_local std::vector<Crossing> gCrossings;
+
+    auto& edges = gEdges;
+    auto& active = gActiveEdges;
+    auto& crossings = gCrossings;
+    edges.clear();
+    active.clear();
+
+    for (auto p = 0u; p < polygons.size(); p++) {
+        auto& vertices = polygons[p];
+        if (vertices.size() < 3) {
+            continue;
+        }
+
+        for (size_t i = 0, j = vertices.size() - 1; i < vertices.size(); j = i++) {
+            auto& a = vertices[i];
+            auto& b = vertices[j];
+
+            // Rows y with min <= y < max, horizontal edges never cross a row.
+            auto firstRow = std::max(0, static_cast<int>(std::ceil(std::min(a.y, b.y))));
+            auto lastRow = std::min(image.height, static_cast<int>(std::ceil(std::max(a.y, b.y)))) - 1;
+            if (firstRow <= lastRow) {
+                edges.push_back({ a, b, p, firstRow, lastRow });
+            }
+        }
     }
 
-    auto center = std::accumulate(vertices.begin(), vertices.end(), glm::vec2(0.f)) / (float)vertices.size();
-    std::vector<bool> mask(image.width * image.height, false);
+    std::sort(edges.begin(), edges.end(), [](const Edge& a, const Edge& b) {
+        return a.firstRow < b.firstRow;
+    });
 
-    int i = 0u;
+    auto colorValue = vec2uint(color);
+    size_t nextEdge = 0;
 
-    auto inside = [&](auto x, auto y) {
-        auto index = image.getIndex(x, y);
-        if (index < 0 || mask[index]) {
-            return false;
+    for (auto y = edges.empty() ? image.height : edges[0].firstRow; y < image.height; y++) {
+        while (nextEdge < edges.size() && edges[nextEdge].firstRow == y) {
+            active.push_back(&edges[nextEdge++]);
         }
 
-        return geom::isInsidePoly(vertices, glm::vec2(x, y));
-    };
+        std::erase_if(active, [y](const Edge* edge) {
+            return edge->lastRow < y;
+        });
 
-    auto set = [&](auto x, auto y) {
-        auto index = image.getIndex(x, y);
-        mask[index] = true;
-        auto pixelColor = geom::lerp(uint2vec(image.getPixelData(index)), color, 0.5f);
-        image.setPixelData(index, vec2uint(pixelColor));
-        i++;
-    };
+        if (active.empty()) {
+            if (nextEdge == edges.size()) {
+                break;
+            }
+
+            continue;
+        }
+
+        crossings.clear();
+        auto fy = static_cast<float>(y);
+
+        for (auto edge : active) {
+            auto& a = edge->a;
+            auto& b = edge->b;
+            if ((a.y <= fy && b.y > fy) || (b.y <= fy && a.y > fy)) {
+                crossings.push_back({ edge->polygon, (b.x - a.x) * (fy - a.y) / (b.y - a.y) + a.x });
+            }
+        }
+
+        std::sort(crossings.begin(), crossings.end(), [](const Crossing& a, const Crossing& b) {
+            return a.polygon < b.polygon || (a.polygon == b.polygon && a.x < b.x);
+        });
+
+        // A pixel is inside when an odd number of its polygon's crossings lie to the right of it, which holds from
+        // every even crossing up to (but excluding) the next one.
+        auto row = image.rawData.data() + static_cast<size_t>(y) * image.width * 4;
 
-    geom::floodFill(center.x, center.y, inside, set);
+        for (size_t i = 0; i + 1 < crossings.size(); i++) {
+            if (crossings[i].polygon != crossings[i + 1].polygon) {
+                continue;
+            }
+
+            auto begin = std::max(0.f, std::ceil(crossings[i].x));
+            auto end = std::min(static_cast<float>(image.width), std::ceil(crossings[i + 1].x));
+
+            for (auto x = static_cast<int>(begin); x < static_cast<int>(end); x++) {
+                uint32_t pixel;
+                std::memcpy(&pixel, row + x * 4, sizeof(uint32_t));
+                pixel = blendHalf(pixel, colorValue);
+                std::memcpy(row + x * 4, &pixel, sizeof(uint32_t));
+            }
+
+            i++;
+        }
+    }
 
     auto drawPoint = [&](auto pt, auto color) {
         for (auto& cpt : gCrossPixels) {
@@ -67,12 +160,313 @@ void debug::drawPolygon(ImageData& image, std::vector<glm::vec2>& vertices, glm:
         }
     };
 
-    for (auto& pt : vertices) {
-        drawPoint(pt, 0xFFFF00FF);
+    // Markers go on top of every fill.
+    for (auto& vertices : polygons) {
+        if (vertices.size() < 3) {
+            continue;
+        }
+
+        for (auto& pt : vertices) {
+            drawPoint(pt, 0xFFFF00FF);
+        }
+
+        drawPoint(std::accumulate(vertices.begin(), vertices.end(), glm::vec2(0.f)) / (float)vertices.size(),
+            0x00FF00FF);
+    }
+}
+
+bool debug::parseOutputMode(const std::string& name, OutputMode& outMode) {
+    if (name == "full") {
+        outMode = OutputMode::Full;
+    } else if (name == "crops") {
+        outMode = OutputMode::Crops;
+    } else if (name == "sheet") {
+        outMode = OutputMode::Sheet;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+void debug::cropShape(const ImageData& image, const geom::Bounds<int>& shapeBounds,
+    const std::vector<glm::vec2>& polygon, Crop& outCrop) {
+
+    // Wide enough for the crosses drawn on the vertices.
+    const int margin = 2;
+
+    auto region = shapeBounds;
+    for (auto& vertex : polygon) {
+        region.expand(static_cast<int>(std::floor(vertex.x)), static_cast<int>(std::floor(vertex.y)));
+        region.expand(static_cast<int>(std::ceil(vertex.x)), static_cast<int>(std::ceil(vertex.y)));
+    }
+
+    auto minX = std::max(region.min.x - margin, 0);
+    auto minY = std::max(region.min.y - margin, 0);
+    auto maxX = std::min(region.max.x + margin, image.width - 1);
+    auto maxY = std::min(region.max.y + margin, image.height - 1);
+
+    outCrop.width = static_cast<uint32_t>(std::max(maxX - minX + 1, 0));
+    outCrop.height = static_cast<uint32_t>(std::max(maxY - minY + 1, 0));
+    outCrop.pixels.resize(static_cast<size_t>(outCrop.width) * outCrop.height * 4);
+
+    for (auto y = 0u; y < outCrop.height; y++) {
+        std::memcpy(outCrop.pixels.data() + static_cast<size_t>(y) * outCrop.width * 4,
+            image.rawData.data() + (static_cast<size_t>(minY + y) * image.width + minX) * 4,
+            static_cast<size_t>(outCrop.width) * 4);
+    }
+}
+
+void debug::ContactSheet::add(Crop crop) {
+    std::lock_guard lock(mutex);
+    crops.push_back(std::move(crop));
+}
+
+void debug::ContactSheet::compose(std::vector<uint8_t>& outPixels, uint32_t& outWidth, uint32_t& outHeight) {
+    // Transparent pixels between neighbouring crops.
+    const uint32_t gap = 2;
+
+    std::sort(crops.begin(), crops.end(), [](const Crop& a, const Crop& b) {
+        return a.name != b.name ? a.name < b.name : a.index < b.index;
+    });
+
+    // Rows are filled up to a width that makes the sheet roughly square, unless a single crop is wider.
+    uint64_t area = 0;
+    uint32_t rowWidth = 0;
+    for (auto& crop : crops) {
+        area += static_cast<uint64_t>(crop.width + gap) * (crop.height + gap);
+        rowWidth = std::max(rowWidth, crop.width);
+    }
+
+    rowWidth = std::max(rowWidth, static_cast<uint32_t>(std::sqrt(static_cast<double>(area))));
+
+    std::vector<glm::uvec2> positions(crops.size());
+    uint32_t x = 0;
+    uint32_t y = 0;
+    uint32_t rowHeight = 0;
+    outWidth = 0;
+    outHeight = 0;
+
+    for (auto i = 0u; i < crops.size(); i++) {
+        if (x > 0 && x + crops[i].width > rowWidth) {
+            x = 0;
+            y += rowHeight + gap;
+            rowHeight = 0;
+        }
+
+        positions[i] = glm::uvec2(x, y);
+        x += crops[i].width + gap;
+        rowHeight = std::max(rowHeight, crops[i].height);
+
+        outWidth = std::max(outWidth, positions[i].x + crops[i].width);
+        outHeight = std::max(outHeight, y + rowHeight);
+    }
+
+    outPixels.assign(static_cast<size_t>(outWidth) * outHeight * 4, 0);
+
+    for (auto i = 0u; i < crops.size(); i++) {
+        for (auto row = 0u; row < crops[i].height; row++) {
+            std::memcpy(outPixels.data() + (static_cast<size_t>(positions[i].y + row) * outWidth + positions[i].x) * 4,
+                crops[i].pixels.data() + static_cast<size_t>(row) * crops[i].width * 4,
+                static_cast<size_t>(crops[i].width) * 4);
+        }
+    }
+}
+
+// The gift wrapping geom::computeConvexHull used before the monotone chain, kept to compare the two hulls.
+std::vector<int> computeGiftWrappingHull(const std::vector<glm::ivec2>& vertices) {
+    std::vector<int> indices;
+    auto numVertices = static_cast<int>(vertices.size());
+
+    if (numVertices <= 4) {
+        for (auto i = 0; i < numVertices; i++) {
+            indices.push_back(i);
+        }
+
+        return indices;
+    }
+
+    auto determinant = [](const glm::ivec2& a, const glm::ivec2& b, const glm::ivec2& c) {
+        return (b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x);
+    };
+
+    auto maxInt = std::numeric_limits<int>::max();
+    auto leftmostIndex = -1;
+    auto leftmostPoint = glm::ivec2(maxInt, maxInt);
+
+    for (auto i = 0; i < numVertices; i++) {
+        auto& pt = vertices[i];
+        if (pt.x < leftmostPoint.x || (pt.x == leftmostPoint.x && pt.y < leftmostPoint.y)) {
+            leftmostIndex = i;
+            leftmostPoint = pt;
+        }
+    }
+
+    auto pointOnHullIndex = leftmostIndex;
+    int endPointIndex;
+
+    do {
+        indices.push_back(pointOnHullIndex);
+        endPointIndex = 0;
+
+        for (auto i = 1; i < numVertices; i++) {
+            auto bIsLeft = determinant(vertices[endPointIndex], vertices[indices.back()], vertices[i]) < 0;
+
+            if (endPointIndex == pointOnHullIndex || bIsLeft) {
+                endPointIndex = i;
+            }
+        }
+
+        pointOnHullIndex = endPointIndex;
+    } while (endPointIndex != leftmostIndex);
+
+    return indices;
+}
+
+uint32_t readPngUint32(const std::vector<uint8_t>& png, size_t offset) {
+    return (static_cast<uint32_t>(png[offset]) << 24) | (png[offset + 1] << 16) | (png[offset + 2] << 8) |
+        png[offset + 3];
+}
+
+void writePngUint32(std::vector<uint8_t>& png, size_t offset, uint32_t value) {
+    for (auto i = 0; i < 4; i++) {
+        png[offset + i] = static_cast<uint8_t>(value >> (24 - i * 8));
+    }
+}
+
+// Offset of the first chunk of a type in an encoded PNG, which has to contain one.
+size_t findPngChunk(const std::vector<uint8_t>& png, const char* type) {
+    size_t offset = 8;
+    while (std::memcmp(png.data() + offset + 4, type, 4) != 0) {
+        offset += readPngUint32(png, offset) + 12;
+    }
+
+    return offset;
+}
+
+// Recomputes the CRC of the chunk at `offset` after its data was changed.
+void updatePngChunkCrc(std::vector<uint8_t>& png, size_t offset) {
+    auto length = readPngUint32(png, offset);
+    writePngUint32(png, offset + 8 + length, lodepng_crc32(png.data() + offset + 4, length + 4));
+}
+
+// Splits the image data of an encoded PNG into IDAT chunks of at most `pieceSize` bytes, the way other encoders
+// write it.
+std::vector<uint8_t> splitPngImageData(const std::vector<uint8_t>& png, size_t pieceSize) {
+    auto idat = findPngChunk(png, "IDAT");
+    size_t length = readPngUint32(png, idat);
+    std::vector<uint8_t> split(png.begin(), png.begin() + idat);
+
+    for (size_t offset = 0; offset < length; offset += pieceSize) {
+        auto size = std::min(pieceSize, length - offset);
+        auto chunk = split.size();
+        split.resize(chunk + size + 12);
+        writePngUint32(split, chunk, static_cast<uint32_t>(size));
+        std::memcpy(split.data() + chunk + 4, "IDAT", 4);
+        std::memcpy(split.data() + chunk + 8, png.data() + idat + 8 + offset, size);
+        updatePngChunkCrc(split, chunk);
+    }
+
+    split.insert(split.end(), png.begin() + idat + length + 12, png.end());
+    return split;
+}
+
+// Area of the smallest polygon with `vertexCount` sides on the lines of hull edges, trying every combination of edges in
+// hull order. Infinity when none of them forms a convex polygon with its corners inside `limits`.
+double findMinimumEdgePolygonArea(const std::vector<glm::ivec2>& points, const std::vector<int>& hull,
+    uint32_t vertexCount, glm::vec2 limits) {
+
+    auto numHull = static_cast<uint32_t>(hull.size());
+    auto bestArea = std::numeric_limits<double>::infinity();
+
+    auto cross = [](const glm::dvec2& a, const glm::dvec2& b) {
+        return a.x * b.y - a.y * b.x;
+    };
+
+    std::vector<uint32_t> edges(vertexCount);
+    std::iota(edges.begin(), edges.end(), 0u);
+    std::vector<glm::dvec2> corners;
+
+    while (true) {
+        corners.clear();
+
+        for (auto v = 0u; v < vertexCount; v++) {
+            auto a = edges[v];
+            auto b = edges[(v + 1) % vertexCount];
+            auto positionA = glm::dvec2(points[hull[a]]);
+            auto positionB = glm::dvec2(points[hull[b]]);
+            auto directionA = glm::dvec2(points[hull[(a + 1) % numHull]]) - positionA;
+            auto directionB = glm::dvec2(points[hull[(b + 1) % numHull]]) - positionB;
+
+            // The hull has negative winding, every corner has to turn the same way by less than half a circle.
+            auto d = cross(directionA, directionB);
+            if (d >= 0.0) {
+                break;
+            }
+
+            auto corner = positionA + directionA * (cross(positionB - positionA, directionB) / d);
+            if (corner.x < 0.0 || corner.x > limits.x || corner.y < 0.0 || corner.y > limits.y) {
+                break;
+            }
+
+            corners.push_back(corner);
+        }
+
+        if (corners.size() == vertexCount) {
+            auto area = 0.0;
+            for (auto v = 0u; v < vertexCount; v++) {
+                area += cross(corners[v], corners[(v + 1) % vertexCount]);
+            }
+
+            bestArea = std::min(bestArea, 0.5 * std::abs(area));
+        }
+
+        // Next combination in lexicographic order.
+        auto v = static_cast<int>(vertexCount) - 1;
+        while (v >= 0 && edges[v] == numHull - vertexCount + v) {
+            v--;
+        }
+
+        if (v < 0) {
+            return bestArea;
+        }
+
+        edges[v]++;
+        for (auto w = static_cast<uint32_t>(v) + 1; w < vertexCount; w++) {
+            edges[w] = edges[w - 1] + 1;
+        }
     }
-    drawPoint(center, 0x00FF00FF);
 }
 
+// Stream buffer that keeps what is written to it, readable from another thread.
+class RecordingBuffer : public std::streambuf {
+private:
+    std::mutex mutex;
+    std::string text;
+
+public:
+    std::string getText() {
+        std::lock_guard lock(mutex);
+        return text;
+    }
+
+protected:
+    std::streamsize xsputn(const char* data, std::streamsize count) override {
+        std::lock_guard lock(mutex);
+        text.append(data, static_cast<size_t>(count));
+        return count;
+    }
+
+    int overflow(int c) override {
+        if (c != traits_type::eof()) {
+            std::lock_guard lock(mutex);
+            text += traits_type::to_char_type(c);
+        }
+
+        return c;
+    }
+};
+
 void debug::test() {
     assert(uint2vec(0xFF000000) == glm::vec4(1.f, 0.f, 0.f, 0.f));
     assert(uint2vec(0x00FF0000) == glm::vec4(0.f, 1.f, 0.f, 0.f));
@@ -94,4 +488,777 @@ void debug::test() {
     };
 
     assert(geom::getPolyArea(poly) == 60.f);
+
+    // Collinear points along the edges and duplicates are not part of the hull.
+    auto rect = std::vector<glm::ivec2> {
+        glm::ivec2(0, 0), glm::ivec2(1, 0), glm::ivec2(2, 0), glm::ivec2(3, 0),
+        glm::ivec2(0, 1), glm::ivec2(3, 1),
+        glm::ivec2(0, 2), glm::ivec2(1, 2), glm::ivec2(2, 2), glm::ivec2(3, 2),
+        glm::ivec2(3, 2), glm::ivec2(0, 0),
+    };
+
+    std::vector<int> hull;
+    geom::computeConvexHull(rect, hull);
+    assert((hull == std::vector<int> { 0, 6, 9, 3 }));
+
+    // Order of the input does not matter.
+    std::reverse(rect.begin(), rect.end());
+    hull.clear();
+    geom::computeConvexHull(rect, hull);
+    assert(hull.size() == 4 && rect[hull[0]] == glm::ivec2(0, 0) && rect[hull[1]] == glm::ivec2(0, 2));
+
+    auto line = std::vector<glm::ivec2> { glm::ivec2(0, 0), glm::ivec2(1, 1), glm::ivec2(2, 2), glm::ivec2(3, 3) };
+    hull.clear();
+    geom::computeConvexHull(line, hull);
+    assert((hull == std::vector<int> { 0, 3 }));
+
+    // Outline of a disc: every point is inside the hull and every hull vertex is a strict turn.
+    std::vector<glm::ivec2> disc;
+    for (int y = -20; y <= 20; y++) {
+        auto halfWidth = (int)std::sqrt(400.f - y * y);
+        disc.emplace_back(glm::ivec2(-halfWidth, y));
+        disc.emplace_back(glm::ivec2(halfWidth, y));
+    }
+
+    hull.clear();
+    geom::computeConvexHull(disc, hull);
+    assert(disc[hull[0]] == glm::ivec2(-20, 0));
+
+    for (auto i = 0u; i < hull.size(); i++) {
+        auto& a = disc[hull[i]];
+        auto& b = disc[hull[(i + 1) % hull.size()]];
+        auto& c = disc[hull[(i + 2) % hull.size()]];
+        assert((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x) < 0);
+
+        for (auto& pt : disc) {
+            assert((b.x - a.x) * (pt.y - a.y) - (b.y - a.y) * (pt.x - a.x) <= 0);
+        }
+    }
+
+    // Neighbor hull candidates of a single shape drawn by `isInside`.
+    auto getOutline = [](int width, int height, auto isInside) {
+        ImageData image;
+        image.width = width;
+        image.height = height;
+        image.rawData.assign(width * height * 4, 0);
+
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x++) {
+                if (isInside(x, y)) {
+                    image.setPixelData(y * width + x, 0xFF000000);
+                }
+            }
+        }
+
+        image.buildOpacityMask();
+        image.findShapes(1, labeling::Method::Runs, labeling::Overflow::Merge);
+
+        std::vector<glm::ivec2> outline;
+        geom::findHullCandidates(image, image.shapes[0], geom::HullCandidates::Neighbors, outline);
+        return outline;
+    };
+
+    // Whether every point lies inside or on the hull, and within the extent of the hull's vertices.
+    auto isEnclosing = [](const std::vector<glm::ivec2>& points, const std::vector<int>& indices) {
+        auto min = points[indices[0]];
+        auto max = min;
+
+        for (auto i = 0u; i < indices.size(); i++) {
+            auto& a = points[indices[i]];
+            auto& b = points[indices[(i + 1) % indices.size()]];
+            min = glm::min(min, a);
+            max = glm::max(max, a);
+
+            for (auto& pt : points) {
+                if ((b.x - a.x) * (pt.y - a.y) - (b.y - a.y) * (pt.x - a.x) > 0) {
+                    return false;
+                }
+            }
+        }
+
+        for (auto& pt : points) {
+            if (pt.x < min.x || pt.y < min.y || pt.x > max.x || pt.y > max.y) {
+                return false;
+            }
+        }
+
+        return true;
+    };
+
+    // Wherever the gift wrapping enclosed the outline, the monotone chain returns the same indices once the gift
+    // wrapping's collinear vertices are left out.
+    auto compareHulls = [&](const std::vector<glm::ivec2>& outline) {
+        auto oldHull = computeGiftWrappingHull(outline);
+        assert(isEnclosing(outline, oldHull));
+
+        std::vector<int> strictHull;
+        for (auto i = 0u; i < oldHull.size(); i++) {
+            auto& a = outline[oldHull[(i + oldHull.size() - 1) % oldHull.size()]];
+            auto& b = outline[oldHull[i]];
+            auto& c = outline[oldHull[(i + 1) % oldHull.size()]];
+
+            if ((b.x - a.x) * (c.y - a.y) - (b.y - a.y) * (c.x - a.x) != 0) {
+                strictHull.push_back(oldHull[i]);
+            }
+        }
+
+        std::vector<int> newHull;
+        geom::computeConvexHull(outline, newHull);
+        assert(newHull == strictHull);
+    };
+
+    compareHulls(getOutline(41, 41, [](int x, int y) { return (x - 20) * (x - 20) + (y - 20) * (y - 20) <= 400; }));
+    compareHulls(getOutline(61, 25, [](int x, int y) {
+        return (x - 30) * (x - 30) * 144 + (y - 12) * (y - 12) * 900 <= 129600;
+    }));
+    // Flat circular segment with long runs of collinear outline pixels along the top.
+    compareHulls(getOutline(400, 40, [](int x, int y) {
+        auto dx = x - 200.0;
+        auto dy = y - 610.0;
+        return y >= 10 && dx * dx + dy * dy <= 600.0 * 600.0;
+    }));
+    compareHulls(getOutline(12, 12, [](int x, int y) { return x >= 11 - y; }));
+    compareHulls(getOutline(10, 10, [](int x, int y) { return x < 3 || y > 6; }));
+
+    std::mt19937 random(12345);
+    for (auto i = 0; i < 20; i++) {
+        std::vector<bool> pixels(16 * 16);
+        for (auto j = 0u; j < pixels.size(); j++) {
+            pixels[j] = random() % 3 != 0;
+        }
+
+        compareHulls(getOutline(16, 16, [&](int x, int y) { return pixels[y * 16 + x]; }));
+    }
+
+    // Outlines the gift wrapping did not enclose. A solid rectangle has only its four corners as candidates, and up
+    // to four points were returned in input order, which crosses itself.
+    auto outline = getOutline(6, 4, [](int, int) { return true; });
+    assert(outline.size() == 4 && !isEnclosing(outline, computeGiftWrappingHull(outline)));
+    hull.clear();
+    geom::computeConvexHull(outline, hull);
+    assert((hull == std::vector<int> { 0, 2, 3, 1 }));
+
+    // A collinear point never replaces the first one found, so on a single row the wrapping turned back at the
+    // second pixel and left the rest of the row outside.
+    outline = getOutline(20, 1, [](int, int) { return true; });
+    assert((computeGiftWrappingHull(outline) == std::vector<int> { 0, 1 }));
+    hull.clear();
+    geom::computeConvexHull(outline, hull);
+    assert((hull == std::vector<int> { 0, 19 }));
+
+    // Along the left edge of this triangle the wrapping stepped to the nearest pixel, and from there the search
+    // started at the previous hull point, collinear behind it. The far corner of the edge was never taken and lies
+    // outside the hull.
+    outline = getOutline(12, 12, [](int x, int y) { return x <= y; });
+    auto oldHull = computeGiftWrappingHull(outline);
+    assert(!isEnclosing(outline, oldHull));
+    assert(std::find(oldHull.begin(), oldHull.end(), 2) == oldHull.end() && outline[2] == glm::ivec2(0, 11));
+    hull.clear();
+    geom::computeConvexHull(outline, hull);
+    assert((hull == std::vector<int> { 0, 2, 4 }));
+
+    // Overflow policies with two shapes allowed: a 5 pixel run, a single pixel and a 3 pixel run lower down, which is
+    // closer to the single pixel.
+    ImageData image;
+    image.width = 12;
+    image.height = 3;
+    image.rawData.assign(image.width * image.height * 4, 0);
+
+    for (auto x : { 0, 1, 2, 3, 4, 7, 33, 34, 35 }) {
+        image.setPixelData(x, 0xFF000000);
+    }
+
+    image.buildOpacityMask();
+
+    for (auto method : { labeling::Method::Runs, labeling::Method::FloodFill }) {
+        assert(image.findShapes(2, method, labeling::Overflow::Merge) == 1);
+        assert(image.shapes[0].bMerged && image.shapes[0].pixelCount == 9 && image.getShapeID(7) == 1);
+
+        assert(image.findShapes(2, method, labeling::Overflow::Largest) == 2);
+        assert(image.shapes[0].pixelCount == 5 && image.shapes[1].pixelCount == 3 && !image.shapes[1].bMerged);
+        assert(image.getShapeID(0) == 1 && image.getShapeID(7) == 0 && image.getShapeID(33) == 2);
+
+        assert(image.findShapes(2, method, labeling::Overflow::Nearest) == 2);
+        assert(!image.shapes[0].bMerged && image.shapes[1].bMerged && image.shapes[1].pixelCount == 4);
+        assert(image.shapes[1].bounds.min == glm::ivec2(7, 0) && image.getShapeID(7) == 2);
+
+        assert(image.findShapes(3, method, labeling::Overflow::Largest) == 3 && image.getShapeID(7) == 2);
+    }
+
+    // Nearest overflow on a scatter of 2x2 blocks, which are kept, and single pixels, which each merge into the block
+    // with the closest bounds, the earliest kept one on ties.
+    std::mt19937 scatterRandom(5);
+    image.width = 96;
+    image.height = 72;
+    image.rawData.assign(image.width * image.height * 4, 0);
+    auto blockCount = 0u;
+    std::vector<glm::ivec2> dots;
+
+    for (auto y = 0; y + 1 < image.height; y += 3) {
+        for (auto x = 0; x + 1 < image.width; x += 3) {
+            auto kind = scatterRandom() % 8;
+            if (kind == 0) {
+                for (auto pixel : { 0, 1, image.width, image.width + 1 }) {
+                    image.setPixelData(y * image.width + x + pixel, 0xFF000000);
+                }
+                blockCount++;
+            } else if (kind < 4) {
+                image.setPixelData(y * image.width + x, 0xFF000000);
+                dots.push_back(glm::ivec2(x, y));
+            }
+        }
+    }
+
+    image.buildOpacityMask();
+
+    for (auto method : { labeling::Method::Runs, labeling::Method::FloodFill }) {
+        assert(image.findShapes(blockCount, method, labeling::Overflow::Largest) == blockCount);
+        std::vector<geom::Bounds<int>> blocks;
+        for (auto& shape : image.shapes) {
+            blocks.push_back(shape.bounds);
+        }
+
+        assert(image.findShapes(blockCount, method, labeling::Overflow::Nearest) == blockCount);
+        for (auto& dot : dots) {
+            auto nearest = 0u;
+            auto nearestDistance = std::numeric_limits<int>::max();
+            for (auto i = 0u; i < blocks.size(); i++) {
+                auto dx = std::max({ 0, blocks[i].min.x - dot.x, dot.x - blocks[i].max.x });
+                auto dy = std::max({ 0, blocks[i].min.y - dot.y, dot.y - blocks[i].max.y });
+                if (dx * dx + dy * dy < nearestDistance) {
+                    nearest = i;
+                    nearestDistance = dx * dx + dy * dy;
+                }
+            }
+
+            assert(image.getShapeID(dot.y * image.width + dot.x) == nearest + 1);
+        }
+    }
+
+    // The rasterizer fills exactly the pixels geom::isInsidePoly reports, also for concave polygons whose centroid lies
+    // outside, and blends overlapping polygons once each.
+    auto canvas = ImageData();
+    canvas.width = 40;
+    canvas.height = 30;
+    canvas.rawData.assign(canvas.width * canvas.height * 4, 0);
+
+    std::vector<std::vector<glm::vec2>> polygons {
+        {
+            glm::vec2(2.f, 2.f), glm::vec2(30.5f, 3.f), glm::vec2(6.f, 8.f), glm::vec2(31.f, 14.2f),
+            glm::vec2(1.5f, 15.f)
+        },
+        { glm::vec2(20.f, 10.f), glm::vec2(45.f, 12.f), glm::vec2(26.f, 33.f) },
+    };
+
+    debug::drawPolygons(canvas, polygons, glm::vec4(1.f, 1.f, 1.f, 1.f));
+
+    for (int y = 0; y < canvas.height; y++) {
+        for (int x = 0; x < canvas.width; x++) {
+            auto bMarker = false;
+            for (auto& vertices : polygons) {
+                auto center = std::accumulate(vertices.begin(), vertices.end(), glm::vec2(0.f)) /
+                    (float)vertices.size();
+                for (auto& pt : vertices) {
+                    bMarker |= std::abs((int)pt.x - x) + std::abs((int)pt.y - y) <= 1;
+                }
+                bMarker |= std::abs((int)center.x - x) + std::abs((int)center.y - y) <= 1;
+            }
+
+            if (bMarker) {
+                continue;
+            }
+
+            // 0xFF halved once per covering polygon.
+            auto expected = 0u;
+            for (auto& vertices : polygons) {
+                if (geom::isInsidePoly(vertices, glm::vec2(x, y))) {
+                    expected = (expected + 0xFF) >> 1;
+                }
+            }
+
+            assert(canvas.getPixelData(y * canvas.width + x) == expected * 0x01010101u);
+        }
+    }
+
+    // Coarse-to-fine fitting still encloses every pixel: a disc, a slanted bar and stray pixels merged into one shape,
+    // away from the image border so that even a triangle fits.
+    image.width = 203;
+    image.height = 131;
+    image.rawData.assign(image.width * image.height * 4, 0);
+
+    for (int y = 0; y < image.height; y++) {
+        for (int x = 0; x < image.width; x++) {
+            auto bDisc = (x - 70) * (x - 70) + (y - 60) * (y - 60) < 45 * 45;
+            auto bBar = std::abs((x - 100) - (y - 40)) < 4 && y > 20 && y < 100;
+            auto bStray = (x * 7 + y * 13) % 509 == 0;
+            if (bDisc || bBar || bStray) {
+                image.setPixelData(y * image.width + x, 0xFF000000);
+            }
+        }
+    }
+
+    image.buildOpacityMask();
+    assert(image.findShapes(1) == 1);
+
+    geom::PolygonSettings settings;
+    settings.pyramidSize = 16;
+
+    for (auto vertexCount : { 4u, 6u, 8u }) {
+        settings.vertexCount = vertexCount;
+
+        std::vector<glm::vec2> polygon;
+        assert(geom::findEnclosingPolygon(image, image.shapes[0], settings, polygon));
+        assert(polygon.size() >= 3 && polygon.size() <= vertexCount);
+
+        auto winding = 0.f;
+        for (auto i = 0u; i < polygon.size(); i++) {
+            auto& a = polygon[i];
+            auto& b = polygon[(i + 1) % polygon.size()];
+            winding += a.x * b.y - b.x * a.y;
+        }
+
+        for (int y = 0; y < image.height; y++) {
+            for (int x = 0; x < image.width; x++) {
+                if (image.getShapeID(y * image.width + x) != 1) {
+                    continue;
+                }
+
+                for (auto i = 0u; i < polygon.size(); i++) {
+                    auto& a = polygon[i];
+                    auto& b = polygon[(i + 1) % polygon.size()];
+                    auto side = ((b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x)) / glm::distance(a, b);
+                    assert(winding > 0.f ? side >= -1e-3f : side <= 1e-3f);
+                }
+            }
+        }
+    }
+
+    // The time budget starts when the first chunk runs, so a search that waited for a worker still evaluates
+    // candidates instead of giving up on the shape.
+    {
+        settings.vertexCount = 6;
+        settings.pyramidSize = 0;
+        settings.solver = geom::PolygonSolver::Random;
+        settings.timeBudgetMs = 1;
+
+        geom::PolygonSearch search;
+        geom::beginPolygonSearch(image, image.shapes[0], settings, search);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+
+        for (auto chunk = 0u; chunk < geom::getPolygonSearchChunks(search); chunk++) {
+            geom::runPolygonSearch(search, chunk);
+        }
+
+        std::vector<glm::vec2> polygon;
+        assert(geom::getPolygonSearchIterations(search) > 0);
+        assert(geom::endPolygonSearch(search, polygon) && polygon.size() == 6);
+    }
+
+    // Crops are clamped to the image, and the sheet orders them by name rather than by when they were added.
+    {
+        ImageData image;
+        image.width = 4;
+        image.height = 3;
+        image.rawData.resize(4 * 3 * 4);
+        for (auto i = 0u; i < 4 * 3; i++) {
+            image.rawData[i * 4] = static_cast<uint8_t>(i);
+        }
+
+        Crop crop;
+        cropShape(image, geom::Bounds<int>(3, 0), {}, crop);
+        assert(crop.width == 3 && crop.height == 3);
+        assert(crop.pixels[0] == 1 && crop.pixels[(2 * 3 + 2) * 4] == 11);
+
+        ContactSheet sheet;
+        crop.name = "b";
+        sheet.add(crop);
+        crop.name = "a";
+        crop.pixels[0] = 200;
+        sheet.add(crop);
+
+        std::vector<uint8_t> pixels;
+        uint32_t width, height;
+        sheet.compose(pixels, width, height);
+        assert(width == 3 && height == 8);
+        assert(pixels[0] == 200 && pixels[5 * 3 * 4] == 1);
+        assert(pixels[3 * 3 * 4 + 3] == 0);
+    }
+
+    // The library reads caller buffers in place: padding past the width is opaque here and must be ignored, and every
+    // pixel format finds the same shapes as an image decoded to RGBA.
+    {
+        const uint32_t width = 37;
+        const uint32_t height = 9;
+        const uint32_t paddedWidth = 40;
+
+        std::vector<uint8_t> rgba(paddedWidth * height * 4, 255);
+        std::vector<uint8_t> argb(paddedWidth * height * 4, 255);
+        std::vector<uint8_t> alpha(paddedWidth * height, 255);
+
+        ImageData image;
+        image.width = width;
+        image.height = height;
+        image.rawData.resize(width * height * 4);
+
+        for (auto y = 0u; y < height; y++) {
+            for (auto x = 0u; x < width; x++) {
+                auto bInside = (x >= 2 && x < 9 && y >= 1 && y < 8) || (x >= 20 && x + y < 40);
+                auto value = static_cast<uint8_t>(bInside ? 200 : 0);
+                rgba[(y * paddedWidth + x) * 4 + 3] = value;
+                argb[(y * paddedWidth + x) * 4] = value;
+                alpha[y * paddedWidth + x] = value;
+                image.rawData[(y * width + x) * 4 + 3] = value;
+            }
+        }
+
+        image.buildOpacityMask();
+        image.findShapes(255);
+        assert(image.shapes.size() == 2);
+
+        std::vector<glm::vec2> vertices;
+        geom::findEnclosingPolygon(image, image.shapes[0], geom::PolygonSettings(), vertices);
+
+        analyzer::ImageView views[] {
+            { rgba.data(), width, height, paddedWidth * 4, analyzer::PixelFormat::RGBA8 },
+            { argb.data(), width, height, paddedWidth * 4, analyzer::PixelFormat::ARGB8 },
+            { alpha.data(), width, height, paddedWidth, analyzer::PixelFormat::A8 },
+        };
+
+        analyzer::Result result;
+        for (auto& view : views) {
+            assert(analyzer::analyze(view, analyzer::Settings(), result));
+            assert(result.shapes.size() == 2);
+            assert(result.shapes[0].x == 20 && result.shapes[0].width == 16 && result.shapes[1].height == 6);
+            assert(result.shapes[0].hull == vertices);
+        }
+
+        analyzer::Settings settings;
+        settings.alphaThreshold = 200;
+        assert(analyzer::analyze(views[0], settings, result) && result.shapes.empty());
+
+        views[0].stride = width * 4 - 1;
+        assert(!analyzer::analyze(views[0], analyzer::Settings(), result));
+    }
+
+    // A single line reaches the stream on its own, without waiting for more lines or for the writer to go away.
+    {
+        RecordingBuffer recording;
+        std::ostream stream(&recording);
+        util::LineWriter writer(stream);
+        writer.write("{}");
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+        while (recording.getText().empty() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        assert(recording.getText() == "{}\n");
+    }
+
+    // Flat circular segments: turning sectors hold few of their hull edges, yet the hull edges solver still finds a
+    // polygon.
+    for (auto radius : { 1940.0, 600.0 }) {
+        uint32_t width = 800;
+        uint32_t height = 120;
+        std::vector<uint8_t> alpha(width * height, 0);
+
+        for (auto y = 60u; y <= 90u; y++) {
+            for (auto x = 0u; x < width; x++) {
+                auto dx = x - 400.0;
+                auto dy = y - 60.0 - radius;
+                alpha[y * width + x] = dx * dx + dy * dy <= radius * radius ? 255 : 0;
+            }
+        }
+
+        analyzer::Settings settings;
+        analyzer::Result result;
+
+        for (auto vertexCount : { 3u, 4u, 6u, 8u }) {
+            settings.polygonSettings.vertexCount = vertexCount;
+            analyzer::ImageView view { alpha.data(), width, height, width, analyzer::PixelFormat::A8 };
+            assert(analyzer::analyze(view, settings, result));
+            assert(result.shapes.size() == 1 && result.shapes[0].hull.size() == vertexCount);
+        }
+    }
+
+    // The hull edges solver finds the smallest polygon with its sides on hull edges: the same area as trying every
+    // combination of edges, and never more than the random search over the same lines.
+    {
+        ImageData image;
+        image.width = 256;
+        image.height = 256;
+        std::mt19937 random(11);
+        auto numCompared = 0;
+
+        for (auto test = 0; test < 60; test++) {
+            image.rawData.assign(image.width * image.height * 4, 0);
+            for (auto i = 0; i < 12; i++) {
+                auto x = 112 + static_cast<int>(random() % 32);
+                auto y = 112 + static_cast<int>(random() % 32);
+                image.setPixelData(y * image.width + x, 0xFF000000);
+            }
+
+            // The stray pixels are merged into one shape.
+            image.buildOpacityMask();
+            assert(image.findShapes(1) == 1);
+
+            geom::PolygonSettings settings;
+            settings.quality = 9;
+            settings.vertexCount = 3 + test % 5;
+
+            std::vector<glm::ivec2> candidates;
+            std::vector<int> hull;
+            geom::findHullCandidates(image, image.shapes[0], settings.candidates, candidates);
+            geom::computeConvexHull(candidates, hull);
+            if (hull.size() <= settings.vertexCount) {
+                continue;
+            }
+
+            // Thin hulls can leave no triangle with its corners inside the image, then the random search takes over.
+            auto bestArea = findMinimumEdgePolygonArea(candidates, hull, settings.vertexCount,
+                glm::vec2(image.width, image.height));
+            if (bestArea == std::numeric_limits<double>::infinity()) {
+                continue;
+            }
+
+            std::vector<glm::vec2> polygon;
+            assert(geom::findEnclosingPolygon(image, image.shapes[0], settings, polygon));
+            assert(polygon.size() == settings.vertexCount);
+            auto area = geom::getPolyArea(polygon);
+            assert(std::abs(area - bestArea) <= 1e-4 * bestArea);
+
+            settings.solver = geom::PolygonSolver::Random;
+            assert(geom::findEnclosingPolygon(image, image.shapes[0], settings, polygon));
+            assert(area <= geom::getPolyArea(polygon) * (1.f + 1e-4f));
+            numCompared++;
+        }
+
+        assert(numCompared >= 20);
+    }
+
+    // Damaged files fail to decode rather than producing a wrong mask: a bad chunk CRC, a zlib stream whose Adler-32
+    // trailer doesn't match its data, and a file cut off before IEND.
+    {
+        std::vector<uint8_t> pixels(16 * 16 * 4, 0);
+        for (auto i = 0u; i < pixels.size(); i += 12) {
+            pixels[i + 3] = 255;
+        }
+
+        std::vector<uint8_t> encoded;
+        lodepng::State state;
+        assert(lodepng::encode(encoded, pixels, 16, 16, state) == 0);
+
+        ImageData image;
+        assert(png::decodeMask(encoded.data(), encoded.size(), image, 0, false));
+
+        auto idat = findPngChunk(encoded, "IDAT");
+        auto crcOffset = idat + 8 + readPngUint32(encoded, idat);
+
+        auto damaged = encoded;
+        damaged[crcOffset] ^= 1;
+        assert(!png::decodeMask(damaged.data(), damaged.size(), image, 0, false));
+
+        damaged = encoded;
+        damaged[crcOffset - 1] ^= 1;
+        updatePngChunkCrc(damaged, idat);
+        assert(!png::decodeMask(damaged.data(), damaged.size(), image, 0, false));
+
+        damaged.assign(encoded.begin(), encoded.begin() + findPngChunk(encoded, "IEND"));
+        assert(!png::decodeMask(damaged.data(), damaged.size(), image, 0, false));
+
+        // Headers asking for too many pixels, or for a single row that's too long, are turned down before anything
+        // is allocated.
+        auto ihdr = findPngChunk(encoded, "IHDR");
+        for (auto [width, height] : { std::pair(500000u, 500000u), std::pair(1u << 26, 1u) }) {
+            damaged = encoded;
+            writePngUint32(damaged, ihdr + 8, width);
+            writePngUint32(damaged, ihdr + 12, height);
+            updatePngChunkCrc(damaged, ihdr);
+            assert(!png::decodeMask(damaged.data(), damaged.size(), image, 0, false));
+            assert(!png::decodeMask(damaged.data(), damaged.size(), image, 0, true));
+        }
+    }
+
+    // The streaming decoder builds the same mask as lodepng for every color type and bit depth, including palettes
+    // with a tRNS chunk shorter than the palette, grey and RGB color keys, 16 bit alpha, all five filter types and
+    // image data split over several IDAT chunks.
+    {
+        const uint32_t width = 37, height = 10;
+        const uint32_t keys[3] { 0x5A3C, 0x96E1, 0x0F78 };
+
+        struct Format {
+            LodePNGColorType colorType;
+            unsigned bitDepth;
+            bool bKey;
+        };
+
+        const Format formats[] {
+            { LCT_GREY, 1, false }, { LCT_GREY, 2, true }, { LCT_GREY, 4, true }, { LCT_GREY, 8, false },
+            { LCT_GREY, 8, true }, { LCT_GREY, 16, true }, { LCT_RGB, 8, false }, { LCT_RGB, 8, true },
+            { LCT_RGB, 16, true }, { LCT_PALETTE, 1, false }, { LCT_PALETTE, 2, false }, { LCT_PALETTE, 4, false },
+            { LCT_PALETTE, 8, false }, { LCT_GREY_ALPHA, 8, false }, { LCT_GREY_ALPHA, 16, false },
+            { LCT_RGBA, 8, false }, { LCT_RGBA, 16, false }
+        };
+
+        uint8_t filters[height];
+        for (auto y = 0u; y < height; y++) {
+            filters[y] = static_cast<uint8_t>(y % 5);
+        }
+
+        std::mt19937 random(7);
+
+        for (auto& format : formats) {
+            lodepng::State state;
+            state.encoder.auto_convert = 0;
+            state.encoder.filter_palette_zero = 0;
+            state.encoder.filter_strategy = LFS_PREDEFINED;
+            state.encoder.predefined_filters = filters;
+
+            auto sampleMask = format.bitDepth == 16 ? 0xFFFFu : (1u << format.bitDepth) - 1;
+
+            for (auto mode : { &state.info_raw, &state.info_png.color }) {
+                mode->colortype = format.colorType;
+                mode->bitdepth = format.bitDepth;
+                mode->key_defined = format.bKey;
+                mode->key_r = keys[0] & sampleMask;
+                mode->key_g = keys[1] & sampleMask;
+                mode->key_b = keys[2] & sampleMask;
+
+                // Only the first half of the entries is translucent, so tRNS ends before the palette does.
+                if (format.colorType == LCT_PALETTE) {
+                    auto size = 1u << format.bitDepth;
+                    for (auto i = 0u; i < size; i++) {
+                        auto alpha = i < size / 2 ? (i * 67) & 255 : 255;
+                        lodepng_palette_add(mode, static_cast<uint8_t>(i), static_cast<uint8_t>(255 - i),
+                            static_cast<uint8_t>(i * 3), static_cast<uint8_t>(alpha));
+                    }
+                }
+            }
+
+            std::vector<uint8_t> pixels(lodepng_get_raw_size(width, height, &state.info_raw));
+            for (auto& value : pixels) {
+                value = static_cast<uint8_t>(random());
+            }
+
+            // Whole byte pixels rarely hit the key at random: every fourth one gets it, and the next one differs from
+            // it only in the lowest byte of one sample, each sample in turn.
+            auto pixelSize = lodepng_get_bpp(&state.info_raw) / 8;
+            if (format.bKey && pixelSize > 0) {
+                auto sampleSize = format.bitDepth / 8;
+                auto channels = pixelSize / sampleSize;
+
+                for (size_t i = 0; i + 2 * pixelSize <= pixels.size(); i += 4 * pixelSize) {
+                    for (auto c = 0u; c < channels; c++) {
+                        auto key = keys[c] & sampleMask;
+                        if (sampleSize == 2) {
+                            pixels[i + c * 2] = static_cast<uint8_t>(key >> 8);
+                            pixels[i + c * 2 + 1] = static_cast<uint8_t>(key);
+                        } else {
+                            pixels[i + c] = static_cast<uint8_t>(key);
+                        }
+                    }
+
+                    std::copy_n(pixels.begin() + i, pixelSize, pixels.begin() + i + pixelSize);
+                    auto changed = i / (4 * pixelSize) % channels;
+                    pixels[i + pixelSize + changed * sampleSize + sampleSize - 1] ^= 1;
+                }
+            }
+
+            std::vector<uint8_t> encoded;
+            assert(lodepng::encode(encoded, pixels, width, height, state) == 0);
+            auto split = splitPngImageData(encoded, 5);
+
+            ImageData expected;
+            uint32_t decodedWidth, decodedHeight;
+            assert(lodepng::decode(expected.rawData, decodedWidth, decodedHeight, encoded) == 0);
+            expected.width = static_cast<int>(decodedWidth);
+            expected.height = static_cast<int>(decodedHeight);
+
+            for (auto alphaThreshold : { 0, 1, 128, 254, 255 }) {
+                expected.buildOpacityMask(static_cast<uint8_t>(alphaThreshold));
+
+                for (auto png : { &encoded, &split }) {
+                    ImageData image;
+                    assert(png::decodeMask(png->data(), png->size(), image, static_cast<uint8_t>(alphaThreshold),
+                        false));
+                    assert(image.width == expected.width && image.height == expected.height);
+
+                    for (int y = 0; y < image.height; y++) {
+                        for (int x = 0; x < image.width; x++) {
+                            assert(image.isOpaque(x, y) == expected.isOpaque(x, y));
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    // Binary output reads back as written, including files without shapes or with an error, and files that are cut
+    // short or point outside themselves are rejected.
+    {
+        const float square[] { 1.f, 2.f, 1.f, 9.f, 8.f, 9.f, 8.f, 2.f };
+
+        polyfile::Writer writer;
+        writer.addFile("sheet.png");
+        writer.addShape(1, 2, 7, 7, square, 4, 49.f);
+        writer.addShape(20, 30, 1, 1, nullptr, 0, 0.f);
+        writer.addFile("empty.png");
+        writer.addFile("broken.png", polyfile::FileError);
+
+        std::string data;
+        assert(writer.serialize(data));
+
+        // The reader needs 4-byte alignment.
+        std::vector<uint32_t> buffer((data.size() + 3) / 4);
+        std::memcpy(buffer.data(), data.data(), data.size());
+
+        polyfile::Reader reader;
+        assert(reader.open(buffer.data(), data.size()));
+        assert(reader.getFileCount() == 3 && reader.getShapeCount() == 2);
+
+        auto& sheet = reader.getFile(0);
+        assert(reader.getPath(sheet) == "sheet.png" && sheet.shapeCount == 2 && sheet.flags == 0);
+
+        auto shapes = reader.getShapes(sheet);
+        assert(shapes[0].x == 1 && shapes[0].y == 2 && shapes[0].width == 7 && shapes[0].height == 7);
+        assert(shapes[0].vertexCount == 4 && shapes[0].area == 49.f);
+        assert(std::memcmp(reader.getVertices(shapes[0]), square, sizeof(square)) == 0);
+        assert(shapes[1].x == 20 && shapes[1].y == 30 && shapes[1].vertexCount == 0);
+
+        auto& empty = reader.getFile(1);
+        assert(reader.getPath(empty) == "empty.png" && empty.shapeCount == 0 && empty.flags == 0);
+
+        auto& broken = reader.getFile(2);
+        assert(reader.getPath(broken) == "broken.png" && broken.shapeCount == 0 &&
+            broken.flags == polyfile::FileError);
+
+        polyfile::Writer emptyWriter;
+        assert(emptyWriter.serialize(data));
+        std::memcpy(buffer.data(), data.data(), data.size());
+        assert(reader.open(buffer.data(), data.size()));
+        assert(reader.getFileCount() == 0 && reader.getShapeCount() == 0);
+
+        assert(writer.serialize(data));
+        for (auto size : { data.size() - 1, sizeof(polyfile::Header) - 1, size_t(0) }) {
+            std::memcpy(buffer.data(), data.data(), data.size());
+            assert(!reader.open(buffer.data(), size) && !reader.isOpen());
+        }
+
+        // Misaligned and out of range table offsets, a path past the string table and vertices past the vertex array.
+        auto corrupt = [&](size_t offset, uint32_t value) {
+            std::memcpy(buffer.data(), data.data(), data.size());
+            std::memcpy(reinterpret_cast<uint8_t*>(buffer.data()) + offset, &value, sizeof(value));
+            return !reader.open(buffer.data(), data.size());
+        };
+
+        auto fileTable = sizeof(polyfile::Header);
+        auto shapeTable = fileTable + 3 * sizeof(polyfile::FileRecord);
+        assert(corrupt(offsetof(polyfile::Header, vertexOffset), shapeTable + 2 * sizeof(polyfile::ShapeRecord) + 2));
+        assert(corrupt(offsetof(polyfile::Header, stringTableOffset), static_cast<uint32_t>(data.size())));
+        assert(corrupt(offsetof(polyfile::Header, shapeCount), 1000));
+        assert(corrupt(fileTable + offsetof(polyfile::FileRecord, pathOffset), 1000));
+        assert(corrupt(fileTable + offsetof(polyfile::FileRecord, shapeCount), 3));
+        assert(corrupt(shapeTable + offsetof(polyfile::ShapeRecord, firstVertex), 1));
+        assert(!corrupt(fileTable + offsetof(polyfile::FileRecord, flags), 0));
+    }
 }
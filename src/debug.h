@@ -1,10 +1,13 @@
 #pragma once
 
 #include <vector>
+#include <string>
+#include <mutex>
 #include <chrono>
 #include <iostream>
 #include <glm/vec2.hpp>
 #include <glm/vec4.hpp>
+#include "geom.h"
 
 namespace debug {
     struct Timer {
@@ -25,7 +28,46 @@ namespace debug {
         }
     };
 
-    void drawPolygon(class ImageData& image, std::vector<glm::vec2>& vertices,
+    // Blends every polygon half way towards `color` in one pass over the image rows, then marks the vertices and the
+    // centroid of each. Pixels are filled by the even-odd rule of geom::isInsidePoly, sampled at their positions.
+    void drawPolygons(class ImageData& image, const std::vector<std::vector<glm::vec2>>& polygons,
         glm::vec4 color = glm::vec4(0.5f, 0.0f, 0.0f, 1.f));
+
+    // What --debug writes: the whole image, one image per shape, or the shapes of every file packed into one.
+    enum class OutputMode {
+        Full,
+        Crops,
+        Sheet
+    };
+
+    bool parseOutputMode(const std::string& name, OutputMode& outMode);
+
+    // RGBA pixels cut out of a debug image around one shape.
+    struct Crop {
+        std::string name;
+        uint32_t index = 0;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        std::vector<uint8_t> pixels;
+    };
+
+    // Copies the bounds of the shape and its polygon plus a small margin, so the vertex marks are included.
+    void cropShape(const class ImageData& image, const geom::Bounds<int>& shapeBounds,
+        const std::vector<glm::vec2>& polygon, Crop& outCrop);
+
+    // Collects crops from any thread and packs them into rows, ordered by name and index so the layout doesn't
+    // depend on which file finished first.
+    class ContactSheet {
+    private:
+        std::mutex mutex;
+        std::vector<Crop> crops;
+
+    public:
+        void add(Crop crop);
+
+        // Empty when nothing was added. Must only be called once nothing is being added anymore.
+        void compose(std::vector<uint8_t>& outPixels, uint32_t& outWidth, uint32_t& outHeight);
+    };
+
     void test();
 }
\ No newline at end of file
@@ -1,11 +1,25 @@
 #include <iostream>
-#include <queue>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <numbers>
+#include <chrono>
 #include <glm/vec2.hpp>
+#include <glm/geometric.hpp>
 #include <effolkronium/random.hpp>
 #include "ImageData.h"
 
+#if defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
 uint32_t gMinIterations = 100000u;
 uint32_t gMaxIterations = 10000000u;
+uint32_t gMinSolverEdges = 24u;
+uint32_t gMaxSolverEdges = 256u;
+uint32_t gIterationsPerChunk = 100000u;
+size_t gMaxCornerTableLines = 1024u;
+const uint32_t gSearchBatchSize = 64u;
 
 glm::ivec2 gNeighborOffsets[] {
     glm::ivec2(-1, -1),
@@ -22,7 +36,7 @@ inline float cross2d(const glm::vec2& a, const glm::vec2& b) {
     return a.x * b.y - a.y * b.x;
 }
 
-bool getIntersection(geom::Line& a, geom::Line& b, glm::vec2& outIntersectionPoint) {
+bool getIntersection(const geom::Line& a, const geom::Line& b, glm::vec2& outIntersectionPoint) {
     float d = cross2d(a.direction, b.direction);
 
     // Lines are parallel.
@@ -51,7 +65,7 @@ uint8_t getNeighborCount(const ImageData& image, const ImageShape& shape, int x,
 
         if (shape.bounds.contains(nx, ny)) {
             auto index = image.getIndex(nx, ny);
-            if (image.getAlpha(index) > 0 && image.getShapeID(index) == shape.id) {
+            if (image.isOpaque(nx, ny) && image.getShapeID(index) == shape.id) {
                 count++;
             }
         }
@@ -64,121 +78,531 @@ void findPotentialHullVertices(const ImageData& image, const ImageShape& shape,
     // Using edge detect find potential hull vertices, where the number of neighbors is less than 5.
     for (int y = shape.bounds.min.y; y <= shape.bounds.max.y; y++) {
         for (int x = shape.bounds.min.x; x <= shape.bounds.max.x; x++) {
-            if (image.getAlpha(image.getIndex(x, y)) > 0 && getNeighborCount(image, shape, x, y) < 5) {
+            if (image.isOpaque(x, y) && getNeighborCount(image, shape, x, y) < 5) {
                 outVertices.emplace_back(glm::ivec2(x, y));
             }
         }
     }
 }
 
-void findOptimalPolygon(const ImageData& image, const std::vector<glm::ivec2>& inVertices,
-    const std::vector<int>& inIndices, uint32_t iterations, std::vector<glm::vec2>& outVertices) {
+void findScanlineExtremes(const ImageData& image, const ImageShape& shape, std::vector<glm::ivec2>& outVertices) {
+    // Only the outermost pixels of every row can end up on the convex hull.
+    for (int y = shape.bounds.min.y; y <= shape.bounds.max.y; y++) {
+        auto row = image.getShapeRow(y);
+        auto left = shape.bounds.min.x;
+        auto right = shape.bounds.max.x;
 
-    if (inIndices.size() <= 8) {
-        // Nothing to do.
-        for (auto index : inIndices) {
-            outVertices.emplace_back(inVertices[index]);
+        while (left <= right && row[left] != shape.id) {
+            left++;
         }
 
-        return;
+        if (left > right) {
+            continue;
+        }
+
+        while (row[right] != shape.id) {
+            right--;
+        }
+
+        outVertices.emplace_back(glm::ivec2(left, y));
+        if (right != left) {
+            outVertices.emplace_back(glm::ivec2(right, y));
+        }
     }
+}
 
-    effolkronium::random_local random;
+void traceContour(const ImageData& image, const ImageShape& shape, std::vector<glm::ivec2>& outVertices) {
+    // Direction from a pixel to its neighbor, indexed by (dy + 1) * 3 + (dx + 1), matching gNeighborOffsets.
+    static const int neighborDirections[] { 0, 1, 2, 7, -1, 3, 6, 5, 4 };
 
-    // Make sure that polygon generation is deterministic.
-    random.seed(12345);
+    auto inside = [&](const glm::ivec2& pt) {
+        return shape.bounds.contains(pt.x, pt.y) && image.getShapeID(image.getIndex(pt.x, pt.y)) == shape.id;
+    };
 
-    std::vector<geom::Line> lines;
-    lines.reserve(inIndices.size());
+    // The first pixel of the topmost row has nothing to the west or above it.
+    auto start = glm::ivec2(shape.bounds.min.x, shape.bounds.min.y);
+    auto row = image.getShapeRow(start.y);
+    while (row[start.x] != shape.id) {
+        start.x++;
+    }
 
-    for (auto i = 0; i < inIndices.size(); i++) {
-        auto pos = inVertices[inIndices[i]];
-        auto dir = inVertices[inIndices[(i + 1) % inIndices.size()]] - pos;
-        lines.emplace_back(geom::Line(pos, dir));
+    auto startOutVertices = outVertices.size();
+    auto current = start;
+    auto backtrack = 7;
+    auto firstDirection = -1;
+
+    outVertices.emplace_back(start);
+
+    while (true) {
+        auto direction = -1;
+
+        for (auto i = 1; i <= 8; i++) {
+            auto candidate = (backtrack + i) % 8;
+            if (inside(current + gNeighborOffsets[candidate])) {
+                direction = candidate;
+                break;
+            }
+        }
+
+        if (direction < 0) {
+            // Single isolated pixel.
+            break;
+        }
+
+        if (current == start) {
+            // Jacob's stopping criterion: leaving the start pixel the same way twice closes the contour.
+            if (direction == firstDirection) {
+                break;
+            }
+
+            if (firstDirection < 0) {
+                firstDirection = direction;
+            }
+        }
+
+        // The last background pixel checked becomes the backtrack point of the next pixel.
+        auto background = current + gNeighborOffsets[(direction + 7) % 8];
+        current += gNeighborOffsets[direction];
+
+        auto delta = background - current;
+        backtrack = neighborDirections[(delta.y + 1) * 3 + (delta.x + 1)];
+
+        if (current != start) {
+            outVertices.emplace_back(current);
+        }
+    }
+
+    // Thin parts of the shape are walked through twice; keep candidates unique and in scanline order.
+    auto begin = outVertices.begin() + startOutVertices;
+    std::sort(begin, outVertices.end(), [](const glm::ivec2& a, const glm::ivec2& b) {
+        return a.y < b.y || (a.y == b.y && a.x < b.x);
+    });
+    outVertices.erase(std::unique(begin, outVertices.end()), outVertices.end());
+}
+
+void geom::findHullCandidates(const ImageData& image, const ImageShape& shape, HullCandidates candidates,
+    std::vector<glm::ivec2>& outVertices) {
+
+    switch (candidates) {
+        case geom::HullCandidates::Neighbors:
+            findPotentialHullVertices(image, shape, outVertices);
+            break;
+        case geom::HullCandidates::Contour:
+            // Tracing only follows one connected component.
+            if (shape.bMerged) {
+                findScanlineExtremes(image, shape, outVertices);
+            } else {
+                traceContour(image, shape, outVertices);
+            }
+            break;
+        case geom::HullCandidates::Extremes:
+            findScanlineExtremes(image, shape, outVertices);
+            break;
     }
+}
 
-    uint32_t maxLineIndex = lines.size() - 1;
+bool intersectSearchLines(const geom::PolygonSearch& search, size_t a, size_t b, glm::vec2& outCorner) {
+    return getIntersection(search.lines[a], search.lines[b], outCorner) && outCorner.x >= 0.f &&
+        outCorner.x <= search.limits.x && outCorner.y >= 0.f && outCorner.y <= search.limits.y;
+}
+
+bool getSearchCorner(const geom::PolygonSearch& search, size_t a, size_t b, glm::vec2& outCorner) {
+    if (!search.corners.empty()) {
+        outCorner = search.corners[a * search.lines.size() + b];
+        return !std::isnan(outCorner.x);
+    }
+
+    return intersectSearchLines(search, a, b, outCorner);
+}
+
+void computeSearchAreas(const float (*xs)[gSearchBatchSize], const float (*ys)[gSearchBatchSize],
+    uint32_t vertexCount, uint32_t count, float* outAreas) {
+
+    // Same operations in the same order as the scalar loop, so every lane gives a bit exact result.
+    uint32_t i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 4 <= count; i += 4) {
+        auto x0 = _mm_load_ps(xs[0] + i);
+        auto y0 = _mm_load_ps(ys[0] + i);
+        auto prevX = _mm_sub_ps(_mm_load_ps(xs[1] + i), x0);
+        auto prevY = _mm_sub_ps(_mm_load_ps(ys[1] + i), y0);
+        auto area = _mm_setzero_ps();
+
+        for (auto v = 2u; v < vertexCount; v++) {
+            auto currX = _mm_sub_ps(_mm_load_ps(xs[v] + i), x0);
+            auto currY = _mm_sub_ps(_mm_load_ps(ys[v] + i), y0);
+            area = _mm_add_ps(area, _mm_sub_ps(_mm_mul_ps(prevY, currX), _mm_mul_ps(prevX, currY)));
+            prevX = currX;
+            prevY = currY;
+        }
+
+        _mm_storeu_ps(outAreas + i, area);
+    }
+#endif
+
+    for (; i < count; i++) {
+        auto area = 0.f;
+        auto prevX = xs[1][i] - xs[0][i];
+        auto prevY = ys[1][i] - ys[0][i];
+
+        for (auto v = 2u; v < vertexCount; v++) {
+            auto currX = xs[v][i] - xs[0][i];
+            auto currY = ys[v][i] - ys[0][i];
+            area += prevY * currX - prevX * currY;
+            prevX = currX;
+            prevY = currY;
+        }
+
+        outAreas[i] = area;
+    }
+}
+
+void geom::runPolygonSearch(PolygonSearch& search, uint32_t chunk) {
+    auto& result = search.chunkResults[chunk];
+    auto vertexCount = search.settings.vertexCount;
+    auto iterations = std::min(gIterationsPerChunk, search.iterations - chunk * gIterationsPerChunk);
+
+    effolkronium::random_local random;
+
+    // Make sure that polygon generation is deterministic, no matter which worker runs which chunk.
+    random.seed(search.settings.seed + chunk * 0x9E3779B9u);
+
+    uint32_t maxLineIndex = search.lines.size() - 1;
     auto getRandomLineIndex = [&](uint32_t startIndex) -> size_t {
         return random.get(std::min(startIndex, maxLineIndex), maxLineIndex);
     };
 
+    // Valid candidates are collected per vertex, so their areas can be evaluated side by side.
+    alignas(16) float xs[gMaxPolygonVertices][gSearchBatchSize];
+    alignas(16) float ys[gMaxPolygonVertices][gSearchBatchSize];
+    float areas[gSearchBatchSize];
+    uint32_t batchIterations[gSearchBatchSize];
+    uint32_t batchSize = 0;
+    uint32_t lastImprovement = 0;
+
+    auto flush = [&]() {
+        computeSearchAreas(xs, ys, vertexCount, batchSize, areas);
+
+        for (auto i = 0u; i < batchSize; i++) {
+            if (areas[i] < result.area) {
+                result.area = areas[i];
+                result.vertices.resize(vertexCount);
+                lastImprovement = batchIterations[i];
+
+                for (auto v = 0u; v < vertexCount; v++) {
+                    result.vertices[v] = glm::vec2(xs[v][i], ys[v][i]);
+                }
+            }
+        }
+
+        batchSize = 0;
+    };
+
+    // Convergence is only checked when a batch is evaluated, so where a chunk stops does not depend on timing.
+    auto isConverged = [&](uint32_t iteration) {
+        auto& settings = search.settings;
+        if (settings.stallIterations > 0 && iteration - lastImprovement >= settings.stallIterations) {
+            return true;
+        }
+
+        // Candidate areas are doubled.
+        return result.area * 0.5f <= search.hullArea * (1.f + settings.areaEpsilon);
+    };
+
+    auto bBudget = search.settings.timeBudgetMs > 0;
+    if (bBudget) {
+        auto budget = std::chrono::milliseconds(search.settings.timeBudgetMs);
+        auto deadline = (std::chrono::steady_clock::now() + budget).time_since_epoch().count();
+        std::chrono::steady_clock::rep unset = 0;
+        search.deadline.compare_exchange_strong(unset, deadline);
+    }
+
+    auto isPastDeadline = [&]() {
+        return bBudget && std::chrono::steady_clock::now().time_since_epoch().count() >= search.deadline.load();
+    };
+
+    size_t lineIndices[gMaxPolygonVertices];
+    auto i = 0u;
+
+    for (; i < iterations; i++) {
+        // The first chunk always gets through one stretch of iterations, so every shape evaluates some candidates.
+        if ((i & 1023u) == 0 && (chunk > 0 || i > 0) && isPastDeadline()) {
+            result.bTimedOut = true;
+            break;
+        }
+
+        // Pick lines in hull order, intersecting each with the previous one. Lines are only drawn once the previous
+        // intersection succeeded.
+        lineIndices[0] = getRandomLineIndex(0);
+        lineIndices[1] = getRandomLineIndex(lineIndices[0] + 1);
+
+        auto bValid = true;
+
+        for (auto v = 0u; bValid && v < vertexCount; v++) {
+            glm::vec2 corner;
+            bValid = getSearchCorner(search, lineIndices[v], lineIndices[(v + 1) % vertexCount], corner);
+
+            if (bValid) {
+                xs[v][batchSize] = corner.x;
+                ys[v][batchSize] = corner.y;
+
+                if (v + 2 < vertexCount) {
+                    lineIndices[v + 2] = getRandomLineIndex(lineIndices[v + 1] + 1);
+                }
+            }
+        }
+
+        if (bValid) {
+            batchIterations[batchSize] = i;
+
+            if (++batchSize == gSearchBatchSize) {
+                flush();
+
+                if (isConverged(i)) {
+                    i++;
+                    break;
+                }
+            }
+        }
+    }
+
+    flush();
+
+    result.iterations = i;
+}
+
+// Working memory of findMinimumAreaPolygon. Kept per thread, so fitting a shape doesn't allocate once the buffers have
+// grown to the largest hull seen.
+struct MinimumAreaScratch {
+    std::vector<geom::Line> lines;
+    std::vector<double> crossSums;
+    std::vector<int> edges;
+    std::vector<int> droppedEdges;
+    std::vector<double> caps;
+    std::vector<glm::vec2> corners;
+    std::vector<int> bestEdges;
+    std::vector<double> costs;
+    std::vector<int> parents;
+};
+
+thread_local MinimumAreaScratch gMinimumAreaScratch;
+
+// Every side of the polygon lies on the line of one of the hull edges in gMinimumAreaScratch.edges. The polygon area
+// is the hull area plus the "caps" between consecutive chosen edges, so picking the edges is a cyclic shortest path
+// problem with exactly vertexCount steps, solved by dynamic programming for every first edge. Returns false when the
+// edges form no such polygon with its corners inside the image.
+bool findMinimumAreaEdges(const ImageData& image, const std::vector<glm::ivec2>& inVertices,
+    const std::vector<int>& inIndices, uint32_t vertexCount, std::vector<glm::vec2>& outVertices) {
+
+    auto numHull = static_cast<int>(inIndices.size());
+    auto infinity = std::numeric_limits<double>::infinity();
+    auto& scratch = gMinimumAreaScratch;
+    auto& lines = scratch.lines;
+    auto& crossSums = scratch.crossSums;
+    auto& edges = scratch.edges;
+
+    auto origin = glm::dvec2(inVertices[inIndices[0]]);
+    auto getHullVertex = [&](int i) {
+        return glm::dvec2(inVertices[inIndices[i % numHull]]) - origin;
+    };
+
+    auto cross = [](const glm::dvec2& a, const glm::dvec2& b) {
+        return a.x * b.y - a.y * b.x;
+    };
+
+    auto numEdges = static_cast<int>(edges.size());
+
     auto checkBounds = [&](glm::vec2 pt) {
         return pt.x >= 0.f && pt.x <= image.width && pt.y >= 0.f && pt.y <= image.height;
     };
 
-    outVertices.resize(8, glm::vec2(0.f, 0.f));
-
-    auto minArea = std::numeric_limits<float>::max();
-
-    for (auto i = 0; i < iterations; i++) {
-        auto x = getRandomLineIndex(0);
-        auto y = getRandomLineIndex(x + 1);
-
-        glm::vec2 v0;
-        if (getIntersection(lines[x], lines[y], v0) && checkBounds(v0)) {
-            glm::vec2 v1;
-            auto z = getRandomLineIndex(y + 1);
-            if (getIntersection(lines[y], lines[z], v1) && checkBounds(v1)) {
-                glm::vec2 v2;
-                auto w = getRandomLineIndex(z + 1);
-                if (getIntersection(lines[z], lines[w], v2) && checkBounds(v2)) {
-                    glm::vec2 v3;
-                    auto r = getRandomLineIndex(w + 1);
-                    if (getIntersection(lines[w], lines[r], v3) && checkBounds(v3)) {
-                        glm::vec2 v4;
-                        auto s = getRandomLineIndex(r + 1);
-                        if (getIntersection(lines[r], lines[s], v4) && checkBounds(v4)) {
-                            glm::vec2 v5;
-                            auto t = getRandomLineIndex(s + 1);
-                            if (getIntersection(lines[s], lines[t], v5) && checkBounds(v5)) {
-                                glm::vec2 v6;
-                                auto u = getRandomLineIndex(t + 1);
-                                if (getIntersection(lines[t], lines[u], v6) && checkBounds(v6)) {
-                                    glm::vec2 v7;
-                                    if (getIntersection(lines[u], lines[x], v7) && checkBounds(v7)) {
-                                        auto u0 = v1 - v0;
-                                        auto u1 = v2 - v0;
-                                        auto u2 = v3 - v0;
-                                        auto u3 = v4 - v0;
-                                        auto u4 = v5 - v0;
-                                        auto u5 = v6 - v0;
-                                        auto u6 = v7 - v0;
-
-                                        auto area =
-                                            (u0.y * u1.x - u0.x * u1.y) +
-                                                (u1.y * u2.x - u1.x * u2.y) +
-                                                (u2.y * u3.x - u2.x * u3.y) +
-                                                (u3.y * u4.x - u3.x * u4.y) +
-                                                (u4.y * u5.x - u4.x * u5.y) +
-                                                (u5.y * u6.x - u5.x * u6.y);
-
-                                        if (area < minArea) {
-                                            minArea = area;
-                                            outVertices[0] = v0;
-                                            outVertices[1] = v1;
-                                            outVertices[2] = v2;
-                                            outVertices[3] = v3;
-                                            outVertices[4] = v4;
-                                            outVertices[5] = v5;
-                                            outVertices[6] = v6;
-                                            outVertices[7] = v7;
-                                        }
-                                    }
-                                }
-                            }
-                        }
+    // caps[a * numEdges + b]: area between the line of edge a, the line of edge b and the hull chain between them.
+    auto& caps = scratch.caps;
+    auto& corners = scratch.corners;
+    caps.assign(numEdges * numEdges, infinity);
+    corners.assign(numEdges * numEdges, glm::vec2(0.f));
+
+    for (auto a = 0; a < numEdges; a++) {
+        for (auto b = 0; b < numEdges; b++) {
+            auto& lineA = lines[edges[a]];
+            auto& lineB = lines[edges[b]];
+            auto& corner = corners[a * numEdges + b];
+
+            // The hull has negative winding; the turn from a to b has to be less than half a circle.
+            if (a == b || cross2d(lineA.direction, lineB.direction) >= 0.f) {
+                continue;
+            }
+
+            if (!getIntersection(lineA, lineB, corner) || !checkBounds(corner)) {
+                continue;
+            }
+
+            auto first = edges[a] + 1;
+            auto last = edges[b] < first ? edges[b] + numHull : edges[b];
+            auto pt = glm::dvec2(corner) - origin;
+            auto area = crossSums[last] - crossSums[first] + cross(getHullVertex(last), pt) +
+                cross(pt, getHullVertex(first));
+
+            caps[a * numEdges + b] = 0.5 * std::abs(area);
+        }
+    }
+
+    auto bestArea = infinity;
+    auto& bestEdges = scratch.bestEdges;
+    bestEdges.clear();
+
+    auto& costs = scratch.costs;
+    auto& parents = scratch.parents;
+    costs.assign(vertexCount * numEdges, 0.0);
+    parents.assign(vertexCount * numEdges, 0);
+
+    // Every polygon is found from its lowest candidate edge, so later edges only extend towards the end.
+    for (auto start = 0; start < numEdges; start++) {
+        std::fill(costs.begin(), costs.end(), infinity);
+        costs[start] = 0.0;
+
+        for (auto step = 1; step < vertexCount; step++) {
+            auto prevCosts = costs.data() + (step - 1) * numEdges;
+            auto currCosts = costs.data() + step * numEdges;
+            auto currParents = parents.data() + step * numEdges;
+
+            for (auto b = start + step; b < numEdges; b++) {
+                for (auto a = start + step - 1; a < b; a++) {
+                    auto cost = prevCosts[a] + caps[a * numEdges + b];
+                    if (cost < currCosts[b]) {
+                        currCosts[b] = cost;
+                        currParents[b] = a;
                     }
                 }
             }
         }
+
+        auto lastCosts = costs.data() + (vertexCount - 1) * numEdges;
+        for (auto b = start + 1; b < numEdges; b++) {
+            auto area = lastCosts[b] + caps[b * numEdges + start];
+            if (area < bestArea) {
+                bestArea = area;
+                bestEdges.resize(vertexCount);
+
+                auto edge = b;
+                for (auto step = static_cast<int>(vertexCount) - 1; step >= 0; step--) {
+                    bestEdges[step] = edge;
+                    edge = parents[step * numEdges + edge];
+                }
+            }
+        }
+    }
+
+    if (bestArea == infinity) {
+        return false;
+    }
+
+    for (auto v = 0u; v < vertexCount; v++) {
+        auto next = (v + 1) % vertexCount;
+        outVertices.emplace_back(corners[bestEdges[v] * numEdges + bestEdges[next]]);
+    }
+
+    return true;
+}
+
+bool findMinimumAreaPolygon(const ImageData& image, const std::vector<glm::ivec2>& inVertices,
+    const std::vector<int>& inIndices, uint32_t vertexCount, uint32_t maxEdges, std::vector<glm::vec2>& outVertices) {
+
+    auto numHull = static_cast<int>(inIndices.size());
+    auto& scratch = gMinimumAreaScratch;
+
+    auto& lines = scratch.lines;
+    lines.clear();
+
+    for (auto i = 0; i < numHull; i++) {
+        auto pos = inVertices[inIndices[i]];
+        auto dir = inVertices[inIndices[(i + 1) % numHull]] - pos;
+        lines.emplace_back(geom::Line(pos, dir));
+    }
+
+    // Cap areas are computed from prefix sums of the hull's cross products, relative to the first vertex for
+    // precision. The hull is walked twice so chains can wrap around.
+    auto origin = glm::dvec2(inVertices[inIndices[0]]);
+    auto getHullVertex = [&](int i) {
+        return glm::dvec2(inVertices[inIndices[i % numHull]]) - origin;
+    };
+
+    auto cross = [](const glm::dvec2& a, const glm::dvec2& b) {
+        return a.x * b.y - a.y * b.x;
+    };
+
+    auto& crossSums = scratch.crossSums;
+    crossSums.assign(2 * numHull + 1, 0.0);
+    for (auto i = 0; i < 2 * numHull; i++) {
+        crossSums[i + 1] = crossSums[i] + cross(getHullVertex(i), getHullVertex(i + 1));
+    }
+
+    // Limit the candidate edges by keeping the longest edge for each of maxEdges equal turning angle sectors.
+    auto& edges = scratch.edges;
+    edges.clear();
+
+    auto getLength2 = [&](int edge) {
+        return glm::dot(lines[edge].direction, lines[edge].direction);
+    };
+
+    if (numHull <= maxEdges) {
+        edges.resize(numHull);
+        std::iota(edges.begin(), edges.end(), 0);
+    } else {
+        auto sectorAngle = 2.0 * std::numbers::pi / maxEdges;
+        auto turning = 0.0;
+        auto lastSector = -1;
+        auto& droppedEdges = scratch.droppedEdges;
+        droppedEdges.clear();
+
+        for (auto i = 0; i < numHull; i++) {
+            if (i > 0) {
+                auto& a = lines[i - 1].direction;
+                auto& b = lines[i].direction;
+                turning += std::atan2(std::abs(cross2d(a, b)), glm::dot(a, b));
+            }
+
+            auto sector = static_cast<int>(turning / sectorAngle);
+            if (sector != lastSector) {
+                edges.push_back(i);
+                lastSector = sector;
+            } else if (getLength2(i) > getLength2(edges.back())) {
+                droppedEdges.push_back(edges.back());
+                edges.back() = i;
+            } else {
+                droppedEdges.push_back(i);
+            }
+        }
+
+        // A flat shape turns through few sectors along most of its outline, which can leave fewer edges than the
+        // polygon has sides. Top up with the longest dropped edges.
+        if (edges.size() < vertexCount) {
+            auto numMissing = vertexCount - edges.size();
+            std::partial_sort(droppedEdges.begin(), droppedEdges.begin() + numMissing, droppedEdges.end(),
+                [&](int a, int b) { return getLength2(a) > getLength2(b); });
+
+            edges.insert(edges.end(), droppedEdges.begin(), droppedEdges.begin() + numMissing);
+            std::sort(edges.begin(), edges.end());
+        }
     }
 
-    if (minArea == std::numeric_limits<float>::max()) {
-        outVertices.clear();
+    if (findMinimumAreaEdges(image, inVertices, inIndices, vertexCount, outVertices)) {
+        return true;
     }
+
+    // The reduced edges may still only form polygons with corners outside the image, for example a shallow lens
+    // whose steep ends were dropped. Retry with every hull edge while the solver stays affordable.
+    if (edges.size() == inIndices.size() || inIndices.size() > gMaxSolverEdges) {
+        return false;
+    }
+
+    edges.resize(numHull);
+    std::iota(edges.begin(), edges.end(), 0);
+    return findMinimumAreaEdges(image, inVertices, inIndices, vertexCount, outVertices);
 }
 
-int computeDeterminant(glm::ivec2& a, glm::ivec2& b, glm::ivec2& c) {
+int computeDeterminant(const glm::ivec2& a, const glm::ivec2& b, const glm::ivec2& c) {
     auto x1 = b.x - a.x;
     auto y1 = b.y - a.y;
     auto x2 = c.x - a.x;
@@ -186,72 +610,476 @@ int computeDeterminant(glm::ivec2& a, glm::ivec2& b, glm::ivec2& c) {
     return x1 * y2 - y1 * x2;
 }
 
-void computeConvexHull(std::vector<glm::ivec2>& vertices, std::vector<int>& outIndices) {
-    if (vertices.size() <= 4) {
-        for (auto i = 0; i < vertices.size(); i++) {
-            outIndices.push_back(i);
+// Scanline order of hull candidates that didn't come sorted, per thread.
+thread_local std::vector<int> gHullOrder;
+
+void geom::computeConvexHull(const std::vector<glm::ivec2>& vertices, std::vector<int>& outIndices) {
+    // Andrew's monotone chain over points ordered by scanline. Hull candidates are already produced in that order,
+    // in which case this runs in linear time.
+    auto scanlineOrder = [](const glm::ivec2& a, const glm::ivec2& b) {
+        return a.y < b.y || (a.y == b.y && a.x < b.x);
+    };
+
+    auto numVertices = static_cast<int>(vertices.size());
+    if (numVertices == 0) {
+        return;
+    }
+
+    auto bSorted = std::is_sorted(vertices.begin(), vertices.end(), scanlineOrder);
+    if (!bSorted) {
+        gHullOrder.resize(numVertices);
+        std::iota(gHullOrder.begin(), gHullOrder.end(), 0);
+        std::stable_sort(gHullOrder.begin(), gHullOrder.end(), [&](int a, int b) {
+            return scanlineOrder(vertices[a], vertices[b]);
+        });
+    }
+
+    auto order = [&](int i) {
+        return bSorted ? i : gHullOrder[i];
+    };
+
+    auto start = outIndices.size();
+    outIndices.resize(start + 2 * numVertices);
+    auto hull = outIndices.data() + start;
+    auto k = 0;
+
+    // Only strict turns are kept, so collinear and duplicate points are dropped. Of several equal points the one
+    // with the lowest index is kept.
+    auto push = [&](int index, int minSize) {
+        if (k > 0 && vertices[hull[k - 1]] == vertices[index]) {
+            return;
+        }
+
+        while (k >= minSize && computeDeterminant(vertices[hull[k - 2]], vertices[hull[k - 1]], vertices[index]) >= 0) {
+            k--;
+        }
+
+        hull[k++] = index;
+    };
+
+    for (auto i = 0; i < numVertices; i++) {
+        push(order(i), 2);
+    }
+
+    auto lowerSize = k + 1;
+    for (auto i = numVertices - 2; i >= 0; i--) {
+        push(order(i), lowerSize);
+    }
+
+    // The first point is repeated at the end.
+    k = std::max(1, k - 1);
+    outIndices.resize(start + k);
+
+    // Start at the leftmost (then topmost) point, the same place the gift wrapping started at.
+    auto leftmost = std::min_element(outIndices.begin() + start, outIndices.end(), [&](int a, int b) {
+        auto& pa = vertices[a];
+        auto& pb = vertices[b];
+        return pa.x < pb.x || (pa.x == pb.x && pa.y < pb.y);
+    });
+
+    std::rotate(outIndices.begin() + start, leftmost, outIndices.end());
+}
+
+void geom::buildShapePyramid(const ImageData& image, const ImageShape& shape, uint32_t pyramidSize,
+    ShapePyramid& outPyramid, std::vector<glm::ivec2>& outCandidates) {
+
+    auto& bounds = shape.bounds;
+    auto side = static_cast<uint32_t>(std::max(bounds.getWidth(), bounds.getHeight()) + 1);
+
+    auto factor = 2u;
+    while ((side + factor - 1) / factor > pyramidSize) {
+        factor *= 2;
+    }
+
+    auto& pyramid = outPyramid;
+    pyramid.factor = factor;
+    pyramid.origin = bounds.min;
+    pyramid.size = glm::ivec2((bounds.getWidth() + factor) / factor, (bounds.getHeight() + factor) / factor);
+    pyramid.cells.assign(static_cast<size_t>(pyramid.size.x) * pyramid.size.y, 0);
+    pyramid.image = &image;
+    pyramid.shapeID = shape.id;
+    pyramid.bounds = bounds;
+
+    // A cell stops being scanned once one of its rows hit the shape, so solid shapes cost about one label read per
+    // cell and row.
+    for (int y = bounds.min.y; y <= bounds.max.y; y++) {
+        auto row = image.getShapeRow(y);
+        auto cells = pyramid.cells.data() + static_cast<size_t>((y - bounds.min.y) / factor) * pyramid.size.x;
+
+        for (auto cx = 0; cx < pyramid.size.x; cx++) {
+            if (cells[cx] != 0) {
+                continue;
+            }
+
+            auto x0 = bounds.min.x + cx * static_cast<int>(factor);
+            auto x1 = std::min(x0 + static_cast<int>(factor) - 1, bounds.max.x);
+
+            for (auto x = x0; x <= x1; x++) {
+                if (row[x] == shape.id) {
+                    cells[cx] = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    for (auto cy = 0; cy < pyramid.size.y; cy++) {
+        auto cells = pyramid.cells.data() + static_cast<size_t>(cy) * pyramid.size.x;
+        auto left = 0;
+        auto right = pyramid.size.x - 1;
+
+        while (left <= right && cells[left] == 0) {
+            left++;
+        }
+
+        if (left > right) {
+            continue;
+        }
+
+        while (cells[right] == 0) {
+            right--;
+        }
+
+        auto x0 = bounds.min.x + left * static_cast<int>(factor);
+        auto x1 = std::min(bounds.min.x + (right + 1) * static_cast<int>(factor) - 1, bounds.max.x);
+        auto y0 = bounds.min.y + cy * static_cast<int>(factor);
+        auto y1 = std::min(y0 + static_cast<int>(factor) - 1, bounds.max.y);
+
+        outCandidates.emplace_back(x0, y0);
+        outCandidates.emplace_back(x1, y0);
+        outCandidates.emplace_back(x0, y1);
+        outCandidates.emplace_back(x1, y1);
+    }
+}
+
+bool geom::refinePyramidPolygon(const ShapePyramid& pyramid, std::vector<glm::vec2>& vertices) {
+    auto numVertices = vertices.size();
+    if (numVertices < 3) {
+        return false;
+    }
+
+    auto& image = *pyramid.image;
+    auto factor = static_cast<int>(pyramid.factor);
+
+    // Doubles, so the clipped corners don't drift off the pixels they were moved onto.
+    std::vector<glm::dvec2> polygon(vertices.begin(), vertices.end());
+
+    auto signedArea = 0.0;
+    for (size_t i = 0; i < numVertices; i++) {
+        auto& a = polygon[i];
+        auto& b = polygon[(i + 1) % numVertices];
+        signedArea += a.x * b.y - b.x * a.y;
+    }
+
+    auto winding = signedArea < 0.0 ? -1.0 : 1.0;
+
+    struct HalfPlane {
+        glm::dvec2 normal;
+        double offset;
+    };
+
+    std::vector<HalfPlane> halfPlanes;
+
+    for (size_t i = 0; i < numVertices; i++) {
+        auto direction = polygon[(i + 1) % numVertices] - polygon[i];
+        auto normal = winding * glm::dvec2(direction.y, -direction.x);
+        if (normal.x == 0.0 && normal.y == 0.0) {
+            continue;
+        }
+
+        auto getCellRange = [&](int cx, int cy, double& outMin, double& outMax) {
+            auto x0 = pyramid.origin.x + cx * factor;
+            auto y0 = pyramid.origin.y + cy * factor;
+            auto x1 = std::min(x0 + factor - 1, pyramid.bounds.max.x);
+            auto y1 = std::min(y0 + factor - 1, pyramid.bounds.max.y);
+            outMax = normal.x * (normal.x > 0.0 ? x1 : x0) + normal.y * (normal.y > 0.0 ? y1 : y0);
+            outMin = normal.x * (normal.x > 0.0 ? x0 : x1) + normal.y * (normal.y > 0.0 ? y0 : y1);
+        };
+
+        // Every set cell holds a pixel at least as far out as its nearest corner, so only cells whose farthest corner
+        // reaches past the best of those can hold the pixel the edge ends up touching.
+        auto lowerBound = -std::numeric_limits<double>::infinity();
+
+        for (auto cy = 0; cy < pyramid.size.y; cy++) {
+            for (auto cx = 0; cx < pyramid.size.x; cx++) {
+                if (pyramid.cells[cy * pyramid.size.x + cx] != 0) {
+                    double cellMin, cellMax;
+                    getCellRange(cx, cy, cellMin, cellMax);
+                    lowerBound = std::max(lowerBound, cellMin);
+                }
+            }
+        }
+
+        auto offset = -std::numeric_limits<double>::infinity();
+
+        for (auto cy = 0; cy < pyramid.size.y; cy++) {
+            for (auto cx = 0; cx < pyramid.size.x; cx++) {
+                double cellMin, cellMax;
+                getCellRange(cx, cy, cellMin, cellMax);
+
+                if (pyramid.cells[cy * pyramid.size.x + cx] == 0 || cellMax < lowerBound) {
+                    continue;
+                }
+
+                auto x0 = pyramid.origin.x + cx * factor;
+                auto y0 = pyramid.origin.y + cy * factor;
+                auto x1 = std::min(x0 + factor - 1, pyramid.bounds.max.x);
+                auto y1 = std::min(y0 + factor - 1, pyramid.bounds.max.y);
+
+                // Within a row the outermost pixel is the first one found from the far side.
+                for (auto y = y0; y <= y1; y++) {
+                    auto row = image.getShapeRow(y);
+
+                    if (normal.x >= 0.0) {
+                        for (auto x = x1; x >= x0; x--) {
+                            if (row[x] == pyramid.shapeID) {
+                                offset = std::max(offset, normal.x * x + normal.y * y);
+                                break;
+                            }
+                        }
+                    } else {
+                        for (auto x = x0; x <= x1; x++) {
+                            if (row[x] == pyramid.shapeID) {
+                                offset = std::max(offset, normal.x * x + normal.y * y);
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+
+        // The coarse edge already encloses the shape, it can only move inwards.
+        offset = std::min(offset, glm::dot(normal, polygon[i]));
+        halfPlanes.push_back({ normal, offset });
+    }
+
+    // Clipping the coarse polygon by the moved edges keeps it convex, and an edge moved past its neighbours simply
+    // disappears.
+    std::vector<glm::dvec2> clipped;
+
+    for (auto& halfPlane : halfPlanes) {
+        clipped.clear();
+
+        for (size_t i = 0; i < polygon.size(); i++) {
+            auto& a = polygon[i];
+            auto& b = polygon[(i + 1) % polygon.size()];
+            auto distanceA = glm::dot(halfPlane.normal, a) - halfPlane.offset;
+            auto distanceB = glm::dot(halfPlane.normal, b) - halfPlane.offset;
+
+            if (distanceA <= 0.0) {
+                clipped.push_back(a);
+            }
+
+            if ((distanceA < 0.0 && distanceB > 0.0) || (distanceA > 0.0 && distanceB < 0.0)) {
+                clipped.push_back(a + (b - a) * (distanceA / (distanceA - distanceB)));
+            }
+        }
+
+        polygon.swap(clipped);
+    }
+
+    vertices.clear();
+
+    for (auto& pt : polygon) {
+        auto vertex = glm::vec2(pt);
+        if (vertices.empty() || glm::distance(vertices.back(), vertex) > 1e-4f) {
+            vertices.push_back(vertex);
+        }
+    }
+
+    while (vertices.size() > 1 && glm::distance(vertices.back(), vertices.front()) <= 1e-4f) {
+        vertices.pop_back();
+    }
+
+    if (vertices.size() < 3) {
+        vertices.clear();
+        return false;
+    }
+
+    return true;
+}
+
+void geom::beginPolygonSearch(const ImageData& image, const ImageShape& shape, const PolygonSettings& settings,
+    PolygonSearch& search) {
+
+    search.settings = settings;
+    search.limits = glm::vec2(image.width, image.height);
+    search.candidates.clear();
+    search.hullIndices.clear();
+    search.lines.clear();
+    search.corners.clear();
+    search.vertices.clear();
+    search.chunkResults.clear();
+    search.iterations = 0;
+    search.deadline = 0;
+    search.pyramid.factor = 0;
+
+    auto side = static_cast<uint32_t>(std::max(shape.bounds.getWidth(), shape.bounds.getHeight()) + 1);
+    if (settings.pyramidSize > 0 && side > settings.pyramidSize) {
+        buildShapePyramid(image, shape, settings.pyramidSize, search.pyramid, search.candidates);
+    } else {
+        findHullCandidates(image, shape, settings.candidates, search.candidates);
+    }
+
+    if (search.candidates.empty()) {
+        return;
+    }
+
+    computeConvexHull(search.candidates, search.hullIndices);
+
+    if (search.hullIndices.size() < 3) {
+        return;
+    }
+
+    if (search.hullIndices.size() <= settings.vertexCount) {
+        // Nothing to do.
+        for (auto index : search.hullIndices) {
+            search.vertices.emplace_back(search.candidates[index]);
         }
 
         return;
     }
 
-    auto maxInt = std::numeric_limits<int>::max();
-    auto leftmostIndex = -1;
-    auto leftmostPoint = glm::ivec2(maxInt, maxInt);
+    float alpha = (float)settings.quality / 9.f;
 
-    for (int i = 0; i < vertices.size(); i++) {
-        auto& pt = vertices[i];
-        if (pt.x < leftmostPoint.x || (pt.x == leftmostPoint.x && pt.y < leftmostPoint.y)) {
-            leftmostIndex = i;
-            leftmostPoint = pt;
+    if (settings.solver == PolygonSolver::HullEdges) {
+        uint32_t maxEdges = lerp(gMinSolverEdges, gMaxSolverEdges, alpha * alpha);
+        if (findMinimumAreaPolygon(image, search.candidates, search.hullIndices, settings.vertexCount, maxEdges,
+            search.vertices)) {
+            return;
         }
+
+        // Too large a hull to retry with every edge; the random search still considers all of them.
     }
 
-    auto pointOnHullIndex = leftmostIndex;
-    int endPointIndex;
+    auto numLines = search.hullIndices.size();
+    search.lines.reserve(numLines);
 
-    do {
-        outIndices.push_back(pointOnHullIndex);
-        endPointIndex = 0;
+    for (auto i = 0; i < numLines; i++) {
+        auto pos = search.candidates[search.hullIndices[i]];
+        auto dir = search.candidates[search.hullIndices[(i + 1) % numLines]] - pos;
+        search.lines.emplace_back(Line(pos, dir));
+    }
 
-        for (auto i = 1; i < vertices.size(); i++) {
-            auto bIsLeft =
-                computeDeterminant(vertices[endPointIndex], vertices[outIndices.back()], vertices[i]) < 0;
+    // Every candidate intersects the same few lines over and over, so intersect all pairs up front when it fits.
+    if (numLines <= gMaxCornerTableLines) {
+        auto& corners = search.corners;
+        corners.resize(numLines * numLines);
 
-            if (endPointIndex == pointOnHullIndex || bIsLeft) {
-                endPointIndex = i;
+        for (auto a = 0; a < numLines; a++) {
+            for (auto b = 0; b < numLines; b++) {
+                if (!intersectSearchLines(search, a, b, corners[a * numLines + b])) {
+                    corners[a * numLines + b].x = std::numeric_limits<float>::quiet_NaN();
+                }
             }
         }
+    }
 
-        pointOnHullIndex = endPointIndex;
-    } while (endPointIndex != leftmostIndex);
+    // Same sum as getPolyArea, without copying the hull vertices out.
+    auto hullArea = 0.f;
+    for (auto i = 0; i < numLines; i++) {
+        auto a = glm::vec2(search.candidates[search.hullIndices[i]]);
+        auto b = glm::vec2(search.candidates[search.hullIndices[(i + 1) % numLines]]);
+        hullArea += a.x * b.y - b.x * a.y;
+    }
+
+    search.hullArea = 0.5f * std::abs(hullArea);
+    search.iterations = lerp(gMinIterations, gMaxIterations, alpha * alpha);
+    search.chunkResults.resize((search.iterations + gIterationsPerChunk - 1) / gIterationsPerChunk);
 }
 
-bool geom::findEnclosingPolygon(const ImageData& image, const ImageShape& shape, uint32_t quality,
-    std::vector<glm::vec2>& outVertices) {
+uint32_t geom::getPolygonSearchChunks(const PolygonSearch& search) {
+    return search.chunkResults.size();
+}
+
+uint32_t geom::getPolygonSearchIterations(const PolygonSearch& search) {
+    uint32_t iterations = 0;
+
+    for (auto& result : search.chunkResults) {
+        iterations += result.iterations;
+    }
+
+    return iterations;
+}
+
+bool geom::isPolygonSearchTimedOut(const PolygonSearch& search) {
+    return std::any_of(search.chunkResults.begin(), search.chunkResults.end(), [](auto& result) {
+        return result.bTimedOut;
+    });
+}
 
+bool geom::endPolygonSearch(PolygonSearch& search, std::vector<glm::vec2>& outVertices) {
     outVertices.clear();
 
-    std::vector<glm::ivec2> potentialVertices;
-    findPotentialHullVertices(image, shape, potentialVertices);
+    if (search.chunkResults.empty()) {
+        outVertices = search.vertices;
+    } else {
+        // Ties go to the earliest chunk, so the result only depends on the seed.
+        auto minArea = std::numeric_limits<float>::max();
 
-    if (potentialVertices.empty()) {
-        return false;
+        for (auto& result : search.chunkResults) {
+            if (result.area < minArea) {
+                minArea = result.area;
+                outVertices = result.vertices;
+            }
+        }
+
+        // A search cut short before any candidate was valid still encloses the shape with its hull.
+        if (outVertices.empty()) {
+            for (auto index : search.hullIndices) {
+                outVertices.emplace_back(search.candidates[index]);
+            }
+        }
+    }
+
+    if (search.pyramid.factor > 0) {
+        auto bRefined = refinePyramidPolygon(search.pyramid, outVertices);
+        search.pyramid.image = nullptr;
+        return bRefined;
+    }
+
+    return !outVertices.empty();
+}
+
+bool geom::findEnclosingPolygon(const ImageData& image, const ImageShape& shape, const PolygonSettings& settings,
+    std::vector<glm::vec2>& outVertices) {
+
+    // beginPolygonSearch resets everything but the capacity, so shapes fitted on this thread share one search.
+    thread_local PolygonSearch search;
+    beginPolygonSearch(image, shape, settings, search);
+
+    for (auto chunk = 0u; chunk < getPolygonSearchChunks(search); chunk++) {
+        runPolygonSearch(search, chunk);
     }
 
-    std::vector<int> hullIndices;
-    computeConvexHull(potentialVertices, hullIndices);
+    return endPolygonSearch(search, outVertices);
+}
 
-    if (hullIndices.size() < 3) {
+bool geom::parseHullCandidates(const std::string& name, HullCandidates& outCandidates) {
+    if (name == "neighbors") {
+        outCandidates = HullCandidates::Neighbors;
+    } else if (name == "contour") {
+        outCandidates = HullCandidates::Contour;
+    } else if (name == "extremes") {
+        outCandidates = HullCandidates::Extremes;
+    } else {
         return false;
     }
 
-    float alpha = (float)quality / 9.f;
-    uint32_t iterations = lerp(gMinIterations, gMaxIterations, alpha * alpha);
+    return true;
+}
 
-    findOptimalPolygon(image, potentialVertices, hullIndices, iterations, outVertices);
+bool geom::parsePolygonSolver(const std::string& name, PolygonSolver& outSolver) {
+    if (name == "hull-edges") {
+        outSolver = PolygonSolver::HullEdges;
+    } else if (name == "random") {
+        outSolver = PolygonSolver::Random;
+    } else {
+        return false;
+    }
 
-    return !outVertices.empty();
+    return true;
 }
 
 bool geom::isInsidePoly(const std::vector<glm::vec2>& vertices, const glm::vec2& pt) {
@@ -282,54 +1110,4 @@ float geom::getPolyArea(std::vector<glm::vec2>& v) {
     }
 
     return 0.5f * std::abs(area);
-}
-
-void geom::floodFill(const int seedX, const int seedY, const std::function<bool(int, int)>& inside,
-    const std::function<void(int, int)>& set) {
-
-    std::queue<glm::ivec2> queue;
-
-    auto push = [&](auto x, auto y) {
-        queue.push(glm::ivec2(x, y));
-    };
-
-    auto pop = [&]() {
-        auto value = queue.front();
-        queue.pop();
-        return value;
-    };
-
-    auto scan = [&](auto lx, auto rx, auto y) {
-        bool added = false;
-        for (auto x = lx; x <= rx; x++) {
-            if (!inside(x, y)) {
-                added = false;
-            } else if (!added) {
-                push(x, y);
-                added = true;
-            }
-        }
-    };
-
-    push(seedX, seedY);
-
-    while (!queue.empty()) {
-        auto pt = pop();
-        auto x = pt.x;
-        auto y = pt.y;
-        auto lx = x;
-
-        while (inside(lx - 1, y)) {
-            set(lx - 1, y);
-            lx = lx - 1;
-        }
-
-        while (inside(x, y)) {
-            set(x, y);
-            x = x + 1;
-        }
-
-        scan(lx, x - 1, y + 1);
-        scan(lx, x - 1, y - 1);
-    }
 }
\ No newline at end of file
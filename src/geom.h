@@ -1,7 +1,10 @@
 #pragma once
 
 #include <vector>
-#include <functional>
+#include <string>
+#include <limits>
+#include <chrono>
+#include <atomic>
 #include <glm/vec2.hpp>
 
 class ImageData;
@@ -82,10 +85,159 @@ namespace geom {
         return a * (1.f - alpha) + b * alpha;
     }
 
+    // How pixels that may lie on the convex hull of a shape are collected.
+    enum class HullCandidates {
+        // Every opaque pixel in the shape bounds with less than 5 neighbors.
+        Neighbors,
+        // Outer boundary of the shape, traced with Moore-neighbor tracing.
+        Contour,
+        // Leftmost and rightmost pixel of the shape on every scanline.
+        Extremes
+    };
+
+    enum class PolygonSolver {
+        // Minimum area polygon whose sides lie on lines of hull edges, found by dynamic programming. It's the minimum
+        // over those polygons when the hull has at most as many edges as the quality level allows, every edge up to
+        // 256 at quality 9. The true minimum area polygon can have sides that only touch the hull at a vertex, so
+        // this is an upper bound on that one.
+        HullEdges,
+        // Random search over the hull edge lines.
+        Random
+    };
+
+    const uint32_t gMaxPolygonVertices = 16;
+
+    struct PolygonSettings {
+        // Iterations for the random search, or how many hull edges the hull edges solver considers.
+        uint32_t quality = 0;
+        uint32_t vertexCount = 8;
+        HullCandidates candidates = HullCandidates::Neighbors;
+        PolygonSolver solver = PolygonSolver::HullEdges;
+        uint32_t seed = 12345;
+        // Random search chunks stop after this many iterations without a smaller polygon. 0 disables the check.
+        uint32_t stallIterations = 0;
+        // Random search chunks stop once the polygon is at most this much larger than the hull, relative to its area.
+        float areaEpsilon = 0.f;
+        // Wall clock limit for the random search of a single shape. 0 disables the limit.
+        uint32_t timeBudgetMs = 0;
+        // Shapes wider or taller than this are fitted coarse-to-fine, on a grid of at most this many cells per side.
+        // 0 disables it.
+        uint32_t pyramidSize = 0;
+    };
+
+    // Max-reduced occupancy of a shape: a cell is set when any pixel of the shape lies in its factor x factor block,
+    // so the coarse level never loses coverage.
+    struct ShapePyramid {
+        uint32_t factor = 0;
+        glm::ivec2 origin;
+        glm::ivec2 size;
+        std::vector<uint8_t> cells;
+        // Full resolution labels the coarse polygon is refined against, only valid until endPolygonSearch.
+        const ImageData* image = nullptr;
+        uint32_t shapeID = 0;
+        Bounds<int> bounds;
+    };
+
+    // State of an enclosing polygon search. The random search is split into fixed size chunks with their own seeds,
+    // which can run concurrently; the result does not depend on how the chunks are scheduled.
+    struct PolygonSearch {
+        struct ChunkResult {
+            float area = std::numeric_limits<float>::max();
+            uint32_t iterations = 0;
+            // Set when the chunk stopped at the time budget.
+            bool bTimedOut = false;
+            std::vector<glm::vec2> vertices;
+        };
+
+        PolygonSettings settings;
+        glm::vec2 limits;
+        float hullArea = 0.f;
+        // Steady clock ticks, set by the first chunk that runs, so time spent waiting for a worker isn't counted.
+        std::atomic<std::chrono::steady_clock::rep> deadline { 0 };
+        std::vector<glm::ivec2> candidates;
+        std::vector<int> hullIndices;
+        std::vector<Line> lines;
+        // Intersections of every pair of lines, NaN where the pair can't form a polygon corner.
+        std::vector<glm::vec2> corners;
+        // Result when no random search is needed.
+        std::vector<glm::vec2> vertices;
+        uint32_t iterations = 0;
+        std::vector<ChunkResult> chunkResults;
+        // Set (factor > 0) when the search runs on the coarse level and its result still has to be refined.
+        ShapePyramid pyramid;
+    };
+
     bool isInsidePoly(const std::vector<glm::vec2>& vertices, const glm::vec2& pt);
     float getPolyArea(std::vector<glm::vec2>& vertices);
-    bool findEnclosingPolygon(const ImageData& image, const ImageShape& shape, uint32_t quality,
+    // Returns indices of the strict convex hull vertices, without collinear points. The hull starts at the leftmost
+    // point and has negative winding in image coordinates.
+    void computeConvexHull(const std::vector<glm::ivec2>& vertices, std::vector<int>& outIndices);
+
+    // Pixels of the shape that may lie on its convex hull, a superset of the hull vertices.
+    void findHullCandidates(const ImageData& image, const ImageShape& shape, HullCandidates candidates,
+        std::vector<glm::ivec2>& outVertices);
+    // Builds the pyramid of a shape and its coarse hull candidates: the corners of the outermost cells of every cell
+    // row, in scanline order. Their hull encloses every pixel of the shape.
+    void buildShapePyramid(const ImageData& image, const ImageShape& shape, uint32_t pyramidSize,
+        ShapePyramid& outPyramid, std::vector<glm::ivec2>& outCandidates);
+    // Moves every edge of a polygon fitted on the coarse level inwards until it touches a pixel of the shape, only
+    // looking at full resolution pixels of the cells that can hold the touching one. The result still encloses every
+    // pixel. Returns false when nothing but a degenerate polygon remains.
+    bool refinePyramidPolygon(const ShapePyramid& pyramid, std::vector<glm::vec2>& vertices);
+    void beginPolygonSearch(const ImageData& image, const ImageShape& shape, const PolygonSettings& settings,
+        PolygonSearch& search);
+    uint32_t getPolygonSearchChunks(const PolygonSearch& search);
+    // Random search iterations actually run, after early termination.
+    uint32_t getPolygonSearchIterations(const PolygonSearch& search);
+    // Whether the time budget cut the random search short, which makes the result depend on timing.
+    bool isPolygonSearchTimedOut(const PolygonSearch& search);
+    void runPolygonSearch(PolygonSearch& search, uint32_t chunk);
+    bool endPolygonSearch(PolygonSearch& search, std::vector<glm::vec2>& outVertices);
+    bool findEnclosingPolygon(const ImageData& image, const ImageShape& shape, const PolygonSettings& settings,
         std::vector<glm::vec2>& outVertices);
-    void floodFill(int seedX, int seedY, const std::function<bool(int, int)>& inside,
-        const std::function<void(int, int)>& set);
+    bool parseHullCandidates(const std::string& name, HullCandidates& outCandidates);
+    bool parsePolygonSolver(const std::string& name, PolygonSolver& outSolver);
+
+    // Scanline fill from a seed. `inside(x, y)` has to turn false for pixels once `set(x, y)` was called on them. Both
+    // are template callables, so they are inlined into the loop rather than called through std::function. The queue
+    // is kept per thread, which makes the fill not reentrant from within the callables.
+    template<typename Inside, typename Set>
+    void floodFill(int seedX, int seedY, Inside&& inside, Set&& set) {
+        thread_local std::vector<glm::ivec2> queue;
+        queue.clear();
+
+        auto scan = [&](int lx, int rx, int y) {
+            bool added = false;
+            for (auto x = lx; x <= rx; x++) {
+                if (!inside(x, y)) {
+                    added = false;
+                } else if (!added) {
+                    queue.emplace_back(x, y);
+                    added = true;
+                }
+            }
+        };
+
+        queue.emplace_back(seedX, seedY);
+
+        // First in, first out by walking a read index instead of popping.
+        for (size_t next = 0; next < queue.size(); next++) {
+            auto x = queue[next].x;
+            auto y = queue[next].y;
+            auto lx = x;
+
+            while (inside(lx - 1, y)) {
+                set(lx - 1, y);
+                lx = lx - 1;
+            }
+
+            while (inside(x, y)) {
+                set(x, y);
+                x = x + 1;
+            }
+
+            scan(lx, x - 1, y + 1);
+            scan(lx, x - 1, y - 1);
+        }
+    }
 }
\ No newline at end of file
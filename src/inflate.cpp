@@ -0,0 +1,377 @@
+#include <cstring>
+#include <algorithm>
+#include "inflate.h"
+
+const int gFastBits = 10;
+const size_t gWindowSize = 32768;
+// Most bytes the Adler-32 sums can take before they have to be reduced, so they don't overflow 32 bits.
+const size_t gAdlerBlockSize = 5552;
+const uint32_t gAdlerModulus = 65521;
+
+const uint16_t gLengthBase[] {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+const uint8_t gLengthExtra[] {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+const uint16_t gDistanceBase[] {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097,
+    6145, 8193, 12289, 16385, 24577
+};
+
+const uint8_t gDistanceExtra[] {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+const uint8_t gCodeLengthOrder[] {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+bool inflate::Huffman::build(const uint8_t* lengths, int numSymbols) {
+    std::memset(counts, 0, sizeof(counts));
+    std::memset(fast, 0, sizeof(fast));
+
+    for (auto i = 0; i < numSymbols; i++) {
+        counts[lengths[i]]++;
+    }
+
+    if (counts[0] == numSymbols) {
+        return true;
+    }
+
+    // Over-subscribed code sets are invalid; incomplete ones are allowed.
+    auto left = 1;
+    for (auto length = 1; length < 16; length++) {
+        left = (left << 1) - counts[length];
+        if (left < 0) {
+            return false;
+        }
+    }
+
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (auto length = 1; length < 15; length++) {
+        offsets[length + 1] = offsets[length] + counts[length];
+    }
+
+    for (auto i = 0; i < numSymbols; i++) {
+        if (lengths[i] != 0) {
+            symbols[offsets[lengths[i]]++] = i;
+        }
+    }
+
+    // Canonical codes are assigned in symbol order within each length; reverse them to match the input bit order.
+    auto code = 0;
+    auto index = 0;
+
+    for (auto length = 1; length <= gFastBits; length++) {
+        for (auto i = 0; i < counts[length]; i++, code++, index++) {
+            auto reversed = 0;
+            for (auto bit = 0; bit < length; bit++) {
+                reversed |= ((code >> bit) & 1) << (length - 1 - bit);
+            }
+
+            for (auto fill = reversed; fill < (1 << gFastBits); fill += 1 << length) {
+                fast[fill] = (length << 12) | symbols[index];
+            }
+        }
+
+        code <<= 1;
+    }
+
+    return true;
+}
+
+inflate::Stream::Stream(const uint8_t* data, size_t size)
+    :data(data), size(size), window(gWindowSize) {
+
+    // zlib header: deflate with a window of at most 32KB, no preset dictionary.
+    if (size < 2 || (data[0] & 0x0F) != 8 || (data[0] >> 4) > 7 || (data[0] * 256 + data[1]) % 31 != 0 ||
+        (data[1] & 0x20)) {
+        bError = true;
+    }
+
+    position = 2;
+}
+
+void inflate::Stream::refill() {
+    while (bitCount <= 56) {
+        // Reading past the end yields zero bits; getBits() flags it once they're actually consumed.
+        auto value = position < size ? data[position] : 0;
+        bitBuffer |= static_cast<uint64_t>(value) << bitCount;
+        bitCount += 8;
+        position++;
+    }
+}
+
+uint32_t inflate::Stream::getBits(int count) {
+    if (bitCount < count) {
+        refill();
+    }
+
+    auto value = static_cast<uint32_t>(bitBuffer & ((1ull << count) - 1));
+    bitBuffer >>= count;
+    bitCount -= count;
+
+    if (position - bitCount / 8 > size) {
+        bError = true;
+    }
+
+    return value;
+}
+
+int inflate::Stream::decodeSymbol(const Huffman& huffman) {
+    if (bitCount < 16) {
+        refill();
+    }
+
+    auto entry = huffman.fast[bitBuffer & ((1 << gFastBits) - 1)];
+    if (entry != 0) {
+        getBits(entry >> 12);
+        return entry & 0x0FFF;
+    }
+
+    // Longer codes are decoded bit by bit.
+    auto code = 0;
+    auto first = 0;
+    auto index = 0;
+
+    for (auto length = 1; length < 16; length++) {
+        code |= getBits(1);
+        auto count = huffman.counts[length];
+
+        if (code - count < first) {
+            return huffman.symbols[index + (code - first)];
+        }
+
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+
+    bError = true;
+    return -1;
+}
+
+bool inflate::Stream::readDynamicTables() {
+    auto numLiterals = getBits(5) + 257;
+    auto numDistances = getBits(5) + 1;
+    auto numCodeLengths = getBits(4) + 4;
+
+    if (numLiterals > 286 || numDistances > 30) {
+        return false;
+    }
+
+    uint8_t lengths[286 + 30] {};
+
+    for (auto i = 0u; i < numCodeLengths; i++) {
+        lengths[gCodeLengthOrder[i]] = getBits(3);
+    }
+
+    Huffman codeLengths;
+    if (!codeLengths.build(lengths, 19)) {
+        return false;
+    }
+
+    std::memset(lengths, 0, sizeof(lengths));
+
+    for (auto i = 0u; i < numLiterals + numDistances && !bError;) {
+        auto symbol = decodeSymbol(codeLengths);
+
+        if (symbol < 16) {
+            lengths[i++] = symbol;
+            continue;
+        }
+
+        uint8_t value = 0;
+        uint32_t repeat;
+
+        if (symbol == 16) {
+            if (i == 0) {
+                return false;
+            }
+
+            value = lengths[i - 1];
+            repeat = 3 + getBits(2);
+        } else if (symbol == 17) {
+            repeat = 3 + getBits(3);
+        } else if (symbol == 18) {
+            repeat = 11 + getBits(7);
+        } else {
+            return false;
+        }
+
+        if (i + repeat > numLiterals + numDistances) {
+            return false;
+        }
+
+        while (repeat--) {
+            lengths[i++] = value;
+        }
+    }
+
+    // The end of block code has to be present.
+    if (bError || lengths[256] == 0) {
+        return false;
+    }
+
+    return literals.build(lengths, numLiterals) && distances.build(lengths + numLiterals, numDistances);
+}
+
+bool inflate::Stream::beginBlock() {
+    if (bFinalBlock) {
+        return false;
+    }
+
+    bFinalBlock = getBits(1);
+    auto type = getBits(2);
+
+    if (type == 0) {
+        // Skip to the byte boundary, then LEN and its one's complement.
+        getBits(bitCount % 8);
+        auto length = getBits(16);
+        auto complement = getBits(16);
+
+        if (length != (~complement & 0xFFFF)) {
+            return false;
+        }
+
+        blockType = BlockType::Stored;
+        storedRemaining = length;
+    } else if (type == 1) {
+        uint8_t lengths[288];
+        std::memset(lengths, 8, 144);
+        std::memset(lengths + 144, 9, 112);
+        std::memset(lengths + 256, 7, 24);
+        std::memset(lengths + 280, 8, 8);
+        literals.build(lengths, 288);
+
+        std::memset(lengths, 5, 30);
+        distances.build(lengths, 30);
+
+        blockType = BlockType::Huffman;
+    } else if (type == 2) {
+        if (!readDynamicTables()) {
+            return false;
+        }
+
+        blockType = BlockType::Huffman;
+    } else {
+        return false;
+    }
+
+    return !bError;
+}
+
+void inflate::Stream::emit(uint8_t value, uint8_t*& out) {
+    window[totalOut & (gWindowSize - 1)] = value;
+    totalOut++;
+    *out++ = value;
+}
+
+void inflate::Stream::updateAdler(const uint8_t* bytes, size_t count) {
+    while (count > 0) {
+        auto blockSize = std::min(count, gAdlerBlockSize);
+
+        for (size_t i = 0; i < blockSize; i++) {
+            adlerA += bytes[i];
+            adlerB += adlerA;
+        }
+
+        adlerA %= gAdlerModulus;
+        adlerB %= gAdlerModulus;
+        bytes += blockSize;
+        count -= blockSize;
+    }
+}
+
+bool inflate::Stream::read(uint8_t* out, size_t count) {
+    auto begin = out;
+    auto end = out + count;
+
+    while (out < end && !bError && !bEnded) {
+        if (matchRemaining > 0) {
+            auto from = totalOut - matchDistance;
+            while (matchRemaining > 0 && out < end) {
+                emit(window[from++ & (gWindowSize - 1)], out);
+                matchRemaining--;
+            }
+
+            continue;
+        }
+
+        switch (blockType) {
+            case BlockType::None:
+                if (bFinalBlock) {
+                    bEnded = true;
+                } else if (!beginBlock()) {
+                    bError = true;
+                }
+                break;
+
+            case BlockType::Stored:
+                while (storedRemaining > 0 && out < end) {
+                    emit(getBits(8), out);
+                    storedRemaining--;
+                }
+
+                if (storedRemaining == 0) {
+                    blockType = BlockType::None;
+                }
+                break;
+
+            case BlockType::Huffman: {
+                auto symbol = decodeSymbol(literals);
+
+                if (symbol < 256) {
+                    emit(symbol, out);
+                } else if (symbol == 256) {
+                    blockType = BlockType::None;
+                } else if (symbol <= 285) {
+                    auto lengthIndex = symbol - 257;
+                    matchRemaining = gLengthBase[lengthIndex] + getBits(gLengthExtra[lengthIndex]);
+
+                    auto distanceIndex = decodeSymbol(distances);
+                    if (distanceIndex < 0 || distanceIndex >= 30) {
+                        bError = true;
+                        break;
+                    }
+
+                    matchDistance = gDistanceBase[distanceIndex] + getBits(gDistanceExtra[distanceIndex]);
+                    if (matchDistance > totalOut) {
+                        bError = true;
+                    }
+                } else {
+                    bError = true;
+                }
+                break;
+            }
+        }
+    }
+
+    updateAdler(begin, out - begin);
+    return !bError && out == end;
+}
+
+bool inflate::Stream::finish() {
+    // Output past what the caller needed is allowed, it only counts towards the checksum.
+    uint8_t extra[256];
+    while (read(extra, sizeof(extra))) {
+    }
+
+    if (bError || !bEnded) {
+        return false;
+    }
+
+    // The big endian trailer starts at the next byte boundary.
+    getBits(bitCount % 8);
+    uint32_t checksum = 0;
+    for (auto i = 0; i < 4; i++) {
+        checksum = (checksum << 8) | getBits(8);
+    }
+
+    return !bError && checksum == ((adlerB << 16) | adlerA);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace inflate {
+    struct Huffman {
+        uint16_t counts[16];
+        uint16_t symbols[288];
+        // Codes of up to gFastBits bits, indexed by the next input bits: (length << 12) | symbol, or 0.
+        uint16_t fast[1 << 10];
+
+        bool build(const uint8_t* lengths, int numSymbols);
+    };
+
+    // Incremental zlib decoder. The compressed input has to be fully available, but the output is produced in pieces
+    // of any size and only the last 32KB of it are kept around for back references. The Adler-32 checksum of the output
+    // is kept as it goes and checked by finish().
+    class Stream {
+    private:
+        const uint8_t* data;
+        size_t size;
+        size_t position = 0;
+        uint64_t bitBuffer = 0;
+        int bitCount = 0;
+
+        std::vector<uint8_t> window;
+        size_t totalOut = 0;
+
+        enum class BlockType {
+            None,
+            Stored,
+            Huffman
+        };
+
+        BlockType blockType = BlockType::None;
+        bool bFinalBlock = false;
+        // Set once the final block is done; no more output follows.
+        bool bEnded = false;
+        bool bError = false;
+        uint32_t adlerA = 1;
+        uint32_t adlerB = 0;
+        uint32_t storedRemaining = 0;
+        uint32_t matchRemaining = 0;
+        uint32_t matchDistance = 0;
+
+        Huffman literals;
+        Huffman distances;
+
+    public:
+        Stream(const uint8_t* data, size_t size);
+
+        // Fills the buffer with the next `count` bytes of output. Returns false on corrupt or truncated input, or when
+        // the stream ends first.
+        bool read(uint8_t* out, size_t count);
+        // Decodes whatever output is left and checks the Adler-32 trailer. Returns false when the stream doesn't end
+        // properly or the checksum doesn't match.
+        bool finish();
+
+    private:
+        void refill();
+        uint32_t getBits(int count);
+        int decodeSymbol(const Huffman& huffman);
+        bool beginBlock();
+        bool readDynamicTables();
+        void emit(uint8_t value, uint8_t*& out);
+        void updateAdler(const uint8_t* bytes, size_t count);
+    };
+}
@@ -0,0 +1,398 @@
+#include <algorithm>
+#include <fstream>
+#include <cstring>
+#include "io.h"
+#include "profile.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <cerrno>
+#include <csignal>
+#define IO_MMAP
+#define IO_SOCKETS
+#endif
+
+#if defined(__linux__)
+#include <sys/resource.h>
+#endif
+
+// Reads don't need many threads to keep the storage busy, only enough to overlap their latency.
+const uint32_t gMaxIOThreads = 4;
+// Nice value added to the output thread, so it only gets the CPU time the workers leave over.
+const int gOutputNice = 10;
+const size_t gStreamBufferSize = 64 * 1024;
+// A client that never sends a line break would otherwise grow the line without bound.
+const size_t gMaxLineLength = 64 * 1024;
+
+io::FileData::FileData(std::vector<uint8_t> data)
+    :length(data.size()), buffer(std::move(data)) {
+}
+
+io::FileData::~FileData() {
+#ifdef IO_MMAP
+    if (mapped) {
+        munmap(const_cast<uint8_t*>(mapped), length);
+    }
+#endif
+}
+
+bool io::FileData::open(const char* filePath) {
+#ifdef IO_MMAP
+    auto fd = ::open(filePath, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    length = static_cast<size_t>(info.st_size);
+    if (length > 0) {
+        auto address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address != MAP_FAILED) {
+            mapped = static_cast<const uint8_t*>(address);
+            madvise(address, length, MADV_SEQUENTIAL);
+        }
+    }
+
+    close(fd);
+
+    if (mapped || length == 0) {
+        return true;
+    }
+#endif
+
+    std::ifstream stream(filePath, std::ios::binary | std::ios::ate);
+    if (!stream) {
+        return false;
+    }
+
+    length = static_cast<size_t>(stream.tellg());
+    buffer.resize(length);
+    stream.seekg(0);
+
+    return static_cast<bool>(stream.read(reinterpret_cast<char*>(buffer.data()), length));
+}
+
+void io::FileData::prefault() const {
+#ifdef IO_MMAP
+    if (!mapped) {
+        return;
+    }
+
+    madvise(const_cast<uint8_t*>(mapped), length, MADV_WILLNEED);
+
+    auto pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    volatile uint8_t sink = 0;
+    for (size_t offset = 0; offset < length; offset += pageSize) {
+        sink = sink + mapped[offset];
+    }
+#endif
+}
+
+io::Prefetcher::Prefetcher(std::vector<std::string> filePaths, uint32_t depth)
+    :filePaths(std::move(filePaths)), depth(std::max(depth, 1u)) {
+
+    auto numThreads = std::min<size_t>({ this->depth, gMaxIOThreads, this->filePaths.size() });
+    for (auto i = 0u; i < numThreads; i++) {
+        threads.emplace_back([this] { load(); });
+    }
+}
+
+io::Prefetcher::~Prefetcher() {
+    {
+        std::lock_guard lock(mutex);
+        bStopped = true;
+    }
+
+    slotFreed.notify_all();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+bool io::Prefetcher::next(std::string& outFilePath, std::shared_ptr<FileData>& outFile) {
+    Entry entry;
+
+    {
+        std::unique_lock lock(mutex);
+        fileReady.wait(lock, [this] { return !ready.empty() || numDelivered == filePaths.size(); });
+
+        if (ready.empty()) {
+            return false;
+        }
+
+        entry = std::move(ready.front());
+        ready.pop_front();
+        numDelivered++;
+    }
+
+    // Outside the lock: overwriting a previous file releases its slot.
+    outFilePath = std::move(entry.filePath);
+    outFile = std::move(entry.file);
+    return true;
+}
+
+void io::Prefetcher::load() {
+    while (true) {
+        size_t index;
+
+        {
+            std::unique_lock lock(mutex);
+            slotFreed.wait(lock, [this] { return bStopped || inFlight < depth; });
+
+            if (bStopped || nextIndex == filePaths.size()) {
+                return;
+            }
+
+            index = nextIndex++;
+            inFlight++;
+        }
+
+        std::shared_ptr<FileData> file(new FileData(), [this](FileData* file) {
+            delete file;
+            release();
+        });
+
+        {
+            profile::Scope scope("read", profile::addFile(filePaths[index]));
+
+            if (file->open(filePaths[index].c_str())) {
+                file->prefault();
+            } else {
+                file.reset();
+            }
+        }
+
+        {
+            std::lock_guard lock(mutex);
+            ready.push_back({ filePaths[index], std::move(file) });
+        }
+
+        fileReady.notify_one();
+    }
+}
+
+void io::Prefetcher::release() {
+    {
+        std::lock_guard lock(mutex);
+        inFlight--;
+    }
+
+    slotFreed.notify_one();
+}
+
+io::OutputQueue::OutputQueue(uint32_t capacity)
+    :capacity(std::max(capacity, 1u)), thread([this] { run(); }) {
+}
+
+io::OutputQueue::~OutputQueue() {
+    {
+        std::lock_guard lock(mutex);
+        bStopped = true;
+    }
+
+    jobAdded.notify_one();
+    thread.join();
+}
+
+void io::OutputQueue::submit(std::function<void()> job) {
+    {
+        std::unique_lock lock(mutex);
+        jobTaken.wait(lock, [this] { return jobs.size() < capacity; });
+        jobs.push_back(std::move(job));
+    }
+
+    jobAdded.notify_one();
+}
+
+void io::OutputQueue::run() {
+#if defined(__linux__)
+    // Linux keeps a nice value per thread, and `0` refers to the calling one.
+    setpriority(PRIO_PROCESS, 0, getpriority(PRIO_PROCESS, 0) + gOutputNice);
+#endif
+
+    while (true) {
+        std::function<void()> job;
+
+        {
+            std::unique_lock lock(mutex);
+            jobAdded.wait(lock, [this] { return bStopped || !jobs.empty(); });
+
+            if (jobs.empty()) {
+                return;
+            }
+
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        jobTaken.notify_all();
+        job();
+    }
+}
+
+io::Stream::Stream(int inFd, int outFd, bool bOwned)
+    :inFd(inFd), outFd(outFd), bOwned(bOwned), buffer(gStreamBufferSize) {
+}
+
+io::Stream::~Stream() {
+#ifdef IO_SOCKETS
+    if (bOwned) {
+        close(inFd);
+
+        if (outFd != inFd) {
+            close(outFd);
+        }
+    }
+#endif
+}
+
+bool io::Stream::readLine(std::string& outLine) {
+    outLine.clear();
+
+    while (true) {
+        auto first = buffer.begin() + static_cast<ptrdiff_t>(begin);
+        auto last = buffer.begin() + static_cast<ptrdiff_t>(end);
+        auto newline = std::find(first, last, '\n');
+        outLine.append(first, newline);
+
+        if (outLine.size() > gMaxLineLength) {
+            return false;
+        }
+
+        if (newline != last) {
+            begin = static_cast<size_t>(newline - buffer.begin()) + 1;
+
+            if (!outLine.empty() && outLine.back() == '\r') {
+                outLine.pop_back();
+            }
+
+            return true;
+        }
+
+        // The last line doesn't need a line break.
+        if (!fill()) {
+            return !outLine.empty();
+        }
+    }
+}
+
+bool io::Stream::read(uint8_t* data, size_t size) {
+    while (size > 0) {
+        if (begin == end && !fill()) {
+            return false;
+        }
+
+        auto count = std::min(size, end - begin);
+        std::memcpy(data, buffer.data() + begin, count);
+        begin += count;
+        data += count;
+        size -= count;
+    }
+
+    return true;
+}
+
+bool io::Stream::write(const std::string& data) {
+#ifdef IO_SOCKETS
+    std::lock_guard lock(writeMutex);
+
+    size_t written = 0;
+    while (written < data.size()) {
+        auto count = ::write(outFd, data.data() + written, data.size() - written);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+
+        written += static_cast<size_t>(count);
+    }
+
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool io::Stream::fill() {
+    begin = 0;
+    end = 0;
+
+#ifdef IO_SOCKETS
+    ssize_t count;
+    do {
+        count = ::read(inFd, buffer.data(), buffer.size());
+    } while (count < 0 && errno == EINTR);
+
+    if (count > 0) {
+        end = static_cast<size_t>(count);
+        return true;
+    }
+#endif
+
+    return false;
+}
+
+int io::listenUnix(const std::string& path) {
+#ifdef IO_SOCKETS
+    sockaddr_un address {};
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        return -1;
+    }
+
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, path.c_str(), path.size());
+
+    // Only ever removes a socket, never a file that happens to have the same name.
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+        unlink(path.c_str());
+    }
+
+    auto fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (bind(fd, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    // A client that goes away before its results are written must not end the server.
+    std::signal(SIGPIPE, SIG_IGN);
+
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+int io::acceptConnection(int listener, bool& outRetry) {
+    outRetry = false;
+
+#ifdef IO_SOCKETS
+    while (true) {
+        auto fd = accept(listener, nullptr, nullptr);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED)) {
+            outRetry = fd < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM);
+            return fd;
+        }
+    }
+#else
+    return -1;
+#endif
+}
@@ -0,0 +1,144 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+namespace io {
+    // Read only contents of a whole file. Memory mapped where the platform supports it, read into a buffer otherwise.
+    class FileData {
+    private:
+        const uint8_t* mapped = nullptr;
+        size_t length = 0;
+        std::vector<uint8_t> buffer;
+
+    public:
+        FileData() = default;
+        // Contents that are already in memory.
+        explicit FileData(std::vector<uint8_t> data);
+        FileData(const FileData&) = delete;
+        FileData& operator=(const FileData&) = delete;
+        ~FileData();
+
+        bool open(const char* filePath);
+
+        // Touches every page of a mapping, so the storage latency is paid by the calling thread.
+        void prefault() const;
+
+        const uint8_t* data() const {
+            return mapped ? mapped : buffer.data();
+        }
+
+        size_t size() const {
+            return length;
+        }
+    };
+
+    // Loads files on dedicated I/O threads ahead of whoever consumes them. At most `depth` files are being read or held
+    // in memory at once; a slot is freed when the last reference to a file is dropped.
+    class Prefetcher {
+    private:
+        struct Entry {
+            std::string filePath;
+            std::shared_ptr<FileData> file;
+        };
+
+        std::vector<std::string> filePaths;
+        uint32_t depth;
+
+        std::mutex mutex;
+        std::condition_variable slotFreed;
+        std::condition_variable fileReady;
+        std::deque<Entry> ready;
+        size_t nextIndex = 0;
+        size_t numDelivered = 0;
+        uint32_t inFlight = 0;
+        bool bStopped = false;
+
+        std::vector<std::thread> threads;
+
+    public:
+        Prefetcher(std::vector<std::string> filePaths, uint32_t depth);
+        ~Prefetcher();
+
+        // Blocks until another file is loaded, in completion order. `outFile` is null if the file couldn't be read.
+        // Returns false once every file was handed out. All files have to be released before the prefetcher is.
+        bool next(std::string& outFilePath, std::shared_ptr<FileData>& outFile);
+
+    private:
+        void load();
+        void release();
+    };
+
+    // Runs jobs in submission order on one background thread at lowered priority, for output nobody waits on. At most
+    // `capacity` jobs are pending; submitting more blocks until the thread catches up. Pending jobs are finished before
+    // the queue is destroyed.
+    class OutputQueue {
+    private:
+        uint32_t capacity;
+
+        std::mutex mutex;
+        std::condition_variable jobAdded;
+        std::condition_variable jobTaken;
+        std::deque<std::function<void()>> jobs;
+        bool bStopped = false;
+
+        std::thread thread;
+
+    public:
+        explicit OutputQueue(uint32_t capacity);
+        OutputQueue(const OutputQueue&) = delete;
+        OutputQueue& operator=(const OutputQueue&) = delete;
+        ~OutputQueue();
+
+        void submit(std::function<void()> job);
+
+    private:
+        void run();
+    };
+
+    // Buffered byte stream over a pair of file descriptors: a socket connection, or standard input and output. Reads
+    // come from one thread, writes from any; each write reaches the other side in one piece.
+    class Stream {
+    private:
+        int inFd;
+        int outFd;
+        bool bOwned;
+
+        std::vector<uint8_t> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+
+        std::mutex writeMutex;
+
+    public:
+        // An owned stream closes its descriptors when destroyed.
+        Stream(int inFd, int outFd, bool bOwned);
+        Stream(const Stream&) = delete;
+        Stream& operator=(const Stream&) = delete;
+        ~Stream();
+
+        // Without the line break. False at the end of the stream, and for lines over 64 KiB, after which the stream
+        // should be closed.
+        bool readLine(std::string& outLine);
+        bool read(uint8_t* data, size_t size);
+        bool write(const std::string& data);
+
+    private:
+        bool fill();
+    };
+
+    // Listening Unix domain socket at `path`, replacing the socket file of an earlier run. -1 on failure, or where the
+    // platform has no such sockets.
+    int listenUnix(const std::string& path);
+    // Blocks until a client connects. -1 on failure, with `outRetry` set when the process merely ran out of descriptors
+    // or memory and a later attempt can succeed, and cleared once the listener itself fails.
+    int acceptConnection(int listener, bool& outRetry);
+}
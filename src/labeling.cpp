@@ -0,0 +1,135 @@
+#include <string>
+#include "labeling.h"
+
+void labeling::RunLabeler::reset() {
+    runs.clear();
+    parents.clear();
+    currentY = -1;
+    prevRowBegin = prevRowEnd = prevCursor = 0;
+}
+
+void labeling::RunLabeler::addRun(int y, int x0, int x1) {
+    if (y != currentY) {
+        if (y == currentY + 1 && !runs.empty() && runs.back().y == currentY) {
+            // Previous row is adjacent, find where it starts.
+            prevRowEnd = runs.size();
+            prevRowBegin = prevRowEnd;
+            while (prevRowBegin > 0 && runs[prevRowBegin - 1].y == currentY) {
+                prevRowBegin--;
+            }
+        } else {
+            prevRowBegin = prevRowEnd = runs.size();
+        }
+
+        prevCursor = prevRowBegin;
+        currentY = y;
+    }
+
+    auto index = static_cast<uint32_t>(runs.size());
+    runs.emplace_back(Run(y, x0, x1, index));
+    parents.push_back(index);
+
+    // Runs in the previous row are sorted by x, so skip the ones that end before this run starts for good.
+    while (prevCursor < prevRowEnd && runs[prevCursor].x1 < x0) {
+        prevCursor++;
+    }
+
+    for (auto i = prevCursor; i < prevRowEnd && runs[i].x0 <= x1; i++) {
+        unite(static_cast<uint32_t>(i), index);
+    }
+}
+
+void labeling::RunLabeler::merge(const RunLabeler& other) {
+    if (other.runs.empty()) {
+        return;
+    }
+
+    auto offset = runs.size();
+    auto seamY = other.runs.front().y;
+
+    auto prevBegin = offset;
+    while (prevBegin > 0 && runs[prevBegin - 1].y == seamY - 1) {
+        prevBegin--;
+    }
+
+    runs.insert(runs.end(), other.runs.begin(), other.runs.end());
+    parents.reserve(runs.size());
+
+    for (auto parent : other.parents) {
+        parents.push_back(parent + static_cast<uint32_t>(offset));
+    }
+
+    auto cursor = prevBegin;
+    for (auto i = offset; i < runs.size() && runs[i].y == seamY; i++) {
+        while (cursor < offset && runs[cursor].x1 < runs[i].x0) {
+            cursor++;
+        }
+
+        for (auto j = cursor; j < offset && runs[j].x0 <= runs[i].x1; j++) {
+            unite(static_cast<uint32_t>(j), static_cast<uint32_t>(i));
+        }
+    }
+
+    currentY = other.currentY;
+    prevRowBegin = other.prevRowBegin + offset;
+    prevRowEnd = other.prevRowEnd + offset;
+    prevCursor = other.prevCursor + offset;
+}
+
+uint32_t labeling::RunLabeler::resolve() {
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < runs.size(); i++) {
+        auto root = find(i);
+        // Roots are always the earliest run of a component, so they are labeled before any of their children.
+        runs[i].label = root == i ? ++count : runs[root].label;
+    }
+
+    return count;
+}
+
+uint32_t labeling::RunLabeler::find(uint32_t index) {
+    while (parents[index] != index) {
+        parents[index] = parents[parents[index]];
+        index = parents[index];
+    }
+
+    return index;
+}
+
+void labeling::RunLabeler::unite(uint32_t a, uint32_t b) {
+    a = find(a);
+    b = find(b);
+
+    if (a < b) {
+        parents[b] = a;
+    } else if (b < a) {
+        parents[a] = b;
+    }
+}
+
+bool labeling::parseMethod(const std::string& name, Method& outMethod) {
+    if (name == "runs") {
+        outMethod = Method::Runs;
+    } else if (name == "flood") {
+        outMethod = Method::FloodFill;
+    } else {
+        return false;
+    }
+
+    return true;
+}
+
+bool labeling::parseOverflow(const std::string& name, Overflow& outOverflow) {
+    if (name == "merge") {
+        outOverflow = Overflow::Merge;
+    } else if (name == "largest") {
+        outOverflow = Overflow::Largest;
+    } else if (name == "nearest") {
+        outOverflow = Overflow::Nearest;
+    } else {
+        return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace labeling {
+    enum class Method {
+        FloodFill,
+        Runs
+    };
+
+    // What happens to the components beyond the shape limit.
+    enum class Overflow {
+        // All components are combined into a single shape.
+        Merge,
+        // Only the largest components by pixel count are kept, the rest are dropped.
+        Largest,
+        // The largest components are kept and every other one joins the kept shape closest to it.
+        Nearest
+    };
+
+    struct Run {
+        int y;
+        int x0;
+        int x1;
+        uint32_t label;
+
+        Run(int y, int x0, int x1, uint32_t label)
+            :y(y), x0(x0), x1(x1), label(label) {
+        }
+    };
+
+    // Two-pass connected component labeler working on horizontal runs of opaque pixels. Runs must be added in
+    // raster order; connectivity matches the 4-connected span flood fill.
+    class RunLabeler {
+    public:
+        std::vector<Run> runs;
+
+    private:
+        std::vector<uint32_t> parents;
+        int currentY = -1;
+        size_t prevRowBegin = 0;
+        size_t prevRowEnd = 0;
+        size_t prevCursor = 0;
+
+    public:
+        void reset();
+        void addRun(int y, int x0, int x1);
+
+        // Appends runs labeled independently for the rows directly below this labeler's rows and stitches the
+        // components that cross the seam.
+        void merge(const RunLabeler& other);
+
+        // Resolves provisional labels. Afterwards every run's label is in range [1, n], numbered in the order the
+        // components are first encountered in a raster scan. Returns n.
+        uint32_t resolve();
+
+    private:
+        uint32_t find(uint32_t index);
+        void unite(uint32_t a, uint32_t b);
+    };
+
+    bool parseMethod(const std::string& name, Method& outMethod);
+    bool parseOverflow(const std::string& name, Overflow& outOverflow);
+}
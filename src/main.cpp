@@ -1,9 +1,33 @@
 #include <cxxopts.hpp>
+#include <cstdlib>
+#include <new>
 #include <thread>
 #include <string>
 #include "parsers.h"
+#include "debug.h"
+#include "profile.h"
 #include "util.h"
 
+// Counts allocations per thread for --profile. Everything else goes through the default nothrow and array forms, which
+// forward to these. The sized delete is replaced along with the unsized one so both free the same way.
+void* operator new(std::size_t size) {
+    profile::gThreadAllocations++;
+
+    if (auto pointer = std::malloc(size ? size : 1)) {
+        return pointer;
+    }
+
+    throw std::bad_alloc();
+}
+
+void operator delete(void* pointer) noexcept {
+    std::free(pointer);
+}
+
+void operator delete(void* pointer, std::size_t) noexcept {
+    std::free(pointer);
+}
+
 cxxopts::ParseResult initOptions(int argc, char** argv) {
     using namespace cxxopts;
 
@@ -15,14 +39,63 @@ cxxopts::ParseResult initOptions(int argc, char** argv) {
             ("i,input", "Input PNG image.", value<std::string>())
             ("f,files", "Glob pattern for multiple input files.", value<std::string>())
             ("t,threads", "Thread number.", value<uint32_t>()->default_value(threadNum))
+            ("prefetch", "Number of input files read ahead of the workers.", value<uint32_t>()->default_value("8"))
             ("o,optimize", "Optimization level. (0-9)", value<uint32_t>()->default_value("0"))
+            ("vertices", "Number of polygon vertices. (3-16)", value<uint32_t>()->default_value("8"))
+            ("solver", "Polygon solver. hull-edges finds the smallest polygon with its sides on hull edges. "
+                "(hull-edges, random)", value<std::string>()->default_value("hull-edges"))
+            ("seed", "Seed for the random polygon search.", value<uint32_t>()->default_value("12345"))
+            ("stall-iterations", "Stop the random search after this many iterations without improvement. (0 = off)",
+                value<uint32_t>()->default_value("0"))
+            ("area-epsilon", "Stop the random search once the polygon area is within this fraction of the hull area.",
+                value<float>()->default_value("0"))
+            ("shape-time-budget-ms", "Time limit for the random search of a single shape. (0 = off)",
+                value<uint32_t>()->default_value("0"))
+            ("pyramid",
+                "Fit shapes wider or taller than this many pixels on a downsampled mask first, then refine their edges "
+                "at full resolution. Ignores --hull-candidates for those shapes. (0 = off, otherwise at least 8)",
+                value<uint32_t>()->default_value("0"))
             ("a,analyze", "Add extended analysis data.", value<bool>()->default_value("false"))
-            ("d,debug", "Output debug PNG. File name for single file, or suffix for multiple files.",
+            ("d,debug",
+                "Output debug PNG. File name for single file, or suffix for multiple files. With --debug-mode sheet, "
+                "the file name of the sheet in either case.",
                 value<std::string>())
+            ("debug-mode",
+                "What the debug output contains: the whole image, one image per shape numbered before the extension, or "
+                "every shape of every file in one contact sheet. (full, crops, sheet)",
+                value<std::string>()->default_value("full"))
             ("m,max-shapes",
-                "Maximum shapes to generate polygons for. If there's more shapes detected on the image, they'll be combined into one. (1-255)",
-                value<uint8_t>()->default_value("255"))
+                "Maximum shapes to generate polygons for. If there's more shapes detected on the image, the overflow policy applies.",
+                value<uint32_t>()->default_value("255"))
+            ("overflow",
+                "What happens to the shapes beyond the maximum: combine all shapes into one, keep only the largest, or "
+                "merge every other shape into the nearest kept one, whatever its size. (merge, largest, nearest)",
+                value<std::string>()->default_value("merge"))
+            ("alpha-threshold", "Pixels with alpha above this value are considered opaque. (0-254)",
+                value<uint8_t>()->default_value("0"))
+            ("hull-candidates", "Hull candidate extraction. (neighbors, contour, extremes)",
+                value<std::string>()->default_value("neighbors"))
+            ("l,labeling", "Shape labeling method. (runs, flood)", value<std::string>()->default_value("runs"))
             ("p,pretty", "Prettify generated JSON.", value<bool>()->default_value("false"))
+            ("format", "Output format. (json, bin)", value<std::string>()->default_value("json"))
+            ("grid", "Slice a sprite sheet into COLUMNSxROWS cells, each analyzed separately.", value<std::string>())
+            ("cell-size", "Slice a sprite sheet into cells of WIDTHxHEIGHT pixels, each analyzed separately.",
+                value<std::string>())
+            ("cache-dir", "Directory for cached results of unchanged images. Not used with --debug.",
+                value<std::string>())
+            ("incremental", "Manifest file of the previous run; only files that changed since are analyzed.",
+                value<std::string>())
+            ("ndjson", "Write one JSON line per file as soon as it is done. (multiple files only, ignores --pretty)",
+                value<bool>()->default_value("false"))
+            ("profile", "Write a Chrome trace of every stage to this file and print a summary per stage. (not with a "
+                "--serve socket)", value<std::string>())
+            ("serve",
+                "Keep running and analyze requests from this Unix socket, or from standard input with '-'. Each request "
+                "is a JSON line with an id, a path or the size of the PNG data that follows, and options named like "
+                "the command line ones. Results are JSON lines with the same id, in completion order. PNG data is "
+                "limited to 256 MiB per request, and up to 64 clients are served at once.",
+                value<std::string>())
+            ("self-test", "Run internal consistency checks and exit.")
             ("h,help", "Print usage.");
 
     auto result = opts.parse(argc, argv);
@@ -31,15 +104,36 @@ cxxopts::ParseResult initOptions(int argc, char** argv) {
         util::bail(opts.help().c_str(), 0);
     }
 
+    if (result.count("self-test")) {
+        debug::test();
+        util::bail("All checks passed", 0);
+    }
+
     return result;
 }
 
 int main(int argc, char** argv) {
     auto opts = initOptions(argc, argv);
 
-    if (opts.count("files")) {
-        return parseMultiple(opts);
+    auto bProfile = opts.count("profile") > 0;
+    if (bProfile) {
+        profile::enable();
+    }
+
+    int code;
+    if (opts.count("serve")) {
+        code = parseServe(opts);
     } else {
-        return parseSingle(opts);
+        code = opts.count("files") ? parseMultiple(opts) : parseSingle(opts);
     }
+
+    if (bProfile) {
+        if (!profile::writeTrace(opts["profile"].as<std::string>().c_str())) {
+            util::printError("Failed to write profile");
+        }
+
+        profile::printSummary();
+    }
+
+    return code;
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include <filesystem>
+#include <fstream>
+#include "manifest.h"
+
+using json = nlohmann::json;
+
+bool manifest::getStamp(const std::string& filePath, Stamp& outStamp) {
+    std::error_code error;
+
+    auto size = std::filesystem::file_size(filePath, error);
+    if (error) {
+        return false;
+    }
+
+    auto mtime = std::filesystem::last_write_time(filePath, error);
+    if (error) {
+        return false;
+    }
+
+    outStamp.size = size;
+    outStamp.mtime = static_cast<int64_t>(mtime.time_since_epoch().count());
+    return true;
+}
+
+manifest::Manifest::Manifest(std::string key)
+    :key(std::move(key)) {
+}
+
+void manifest::Manifest::load(const std::string& filePath) {
+    entries.clear();
+
+    std::ifstream stream(filePath, std::ios::binary);
+    if (!stream) {
+        return;
+    }
+
+    auto document = json::parse(stream, nullptr, false);
+    if (document.is_discarded() || !document.is_object() || document.value("key", "") != key ||
+        !document["files"].is_object()) {
+        return;
+    }
+
+    for (auto& [path, entry] : document["files"].items()) {
+        if (!entry.is_object() || !entry.contains("result")) {
+            continue;
+        }
+
+        Stamp stamp;
+        stamp.size = entry.value("size", uint64_t(0));
+        stamp.mtime = entry.value("mtime", int64_t(0));
+
+        entries[path] = { stamp, std::move(entry["result"]) };
+    }
+}
+
+bool manifest::Manifest::save(const std::string& filePath) const {
+    json files = json::object();
+
+    for (auto& [path, entry] : entries) {
+        files[path] = {
+            { "size", entry.stamp.size },
+            { "mtime", entry.stamp.mtime },
+            { "result", entry.result }
+        };
+    }
+
+    json document = {
+        { "key", key },
+        { "files", std::move(files) }
+    };
+
+    // Replaced in one step, an interrupted run leaves the previous manifest intact.
+    auto tmpPath = filePath + ".tmp";
+
+    {
+        std::ofstream stream(tmpPath, std::ios::binary | std::ios::trunc);
+        stream << document.dump();
+
+        if (!stream) {
+            return false;
+        }
+    }
+
+    std::error_code error;
+    std::filesystem::rename(tmpPath, filePath, error);
+
+    return !error;
+}
+
+bool manifest::Manifest::contains(const std::string& path) const {
+    return entries.find(path) != entries.end();
+}
+
+const json* manifest::Manifest::find(const std::string& path, const Stamp& stamp) const {
+    auto it = entries.find(path);
+    if (it == entries.end() || !(it->second.stamp == stamp)) {
+        return nullptr;
+    }
+
+    return &it->second.result;
+}
+
+void manifest::Manifest::set(const std::string& path, const Stamp& stamp, json result) {
+    entries[path] = { stamp, std::move(result) };
+}
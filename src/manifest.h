@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <nlohmann/json.hpp>
+
+namespace manifest {
+    // Cheap change detection for input files, compared instead of reading them.
+    struct Stamp {
+        uint64_t size = 0;
+        int64_t mtime = 0;
+
+        bool operator==(const Stamp& other) const = default;
+    };
+
+    bool getStamp(const std::string& filePath, Stamp& outStamp);
+
+    // Results of a previous run keyed by path, for `--incremental`. A manifest only applies to runs with the same key,
+    // i.e. the same tool version and analysis options.
+    class Manifest {
+    private:
+        struct Entry {
+            Stamp stamp;
+            nlohmann::json result;
+        };
+
+        std::string key;
+        std::unordered_map<std::string, Entry> entries;
+
+    public:
+        explicit Manifest(std::string key);
+
+        // A missing, unreadable or outdated manifest leaves this one empty.
+        void load(const std::string& filePath);
+        bool save(const std::string& filePath) const;
+
+        bool contains(const std::string& path) const;
+
+        // The previous result, if the file didn't change since.
+        const nlohmann::json* find(const std::string& path, const Stamp& stamp) const;
+
+        void set(const std::string& path, const Stamp& stamp, nlohmann::json result);
+
+        size_t size() const {
+            return entries.size();
+        }
+    };
+}
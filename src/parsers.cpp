@@ -1,15 +1,39 @@
 #include <nlohmann/json.hpp>
 #include <glob/glob.h>
 #include <tasks.h>
+#include <atomic>
 #include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <algorithm>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
 #include "parsers.h"
+#include "cache.h"
+#include "manifest.h"
 #include "geom.h"
+#include "io.h"
 #include "debug.h"
 #include "png.h"
+#include "polyfile.h"
+#include "profile.h"
 #include "util.h"
 
 using json = nlohmann::json;
 
+// Minimum number of rows per band when labeling a single image in parallel.
+const int gMinBandHeight = 64;
+// PNG data sent along with a server request is held in memory whole, so larger requests are rejected before anything
+// is allocated. Bigger images can still be sent by path.
+const uint64_t gMaxRequestSize = 256ull << 20;
+// Clients served at once. Further ones wait in the listen backlog until a connection closes.
+const uint32_t gMaxConnections = 64;
+// Waits between attempts to accept a connection after running out of descriptors, doubling up to the maximum.
+const auto gMinAcceptDelay = std::chrono::milliseconds(10);
+const auto gMaxAcceptDelay = std::chrono::milliseconds(1000);
+
 template<typename T>
 json to_json(const geom::Bounds<T>& bounds) {
     return json({
@@ -20,67 +44,255 @@ json to_json(const geom::Bounds<T>& bounds) {
     });
 }
 
-int parseSingle(const cxxopts::ParseResult& opts) {
-    if (!opts.count("input")) {
-        util::bail("No input file specified");
+// Adds one file's result to the binary output. The JSON result is the source of truth for both formats.
+void addBinaryFile(polyfile::Writer& writer, const std::string& path, const json& result) {
+    writer.addFile(path, result.contains("error") ? static_cast<uint32_t>(polyfile::FileError) : 0u);
+
+    if (!result.contains("shapes")) {
+        return;
     }
 
-    auto inFile = opts["input"].as<std::string>();
+    std::vector<glm::vec2> vertices;
 
-    ImageData image;
+    for (auto& shape : result["shapes"]) {
+        vertices.clear();
 
-    if (!png::read(inFile.c_str(), image)) {
-        util::bail("Failed to read PNG file");
+        if (shape["hull"].is_array()) {
+            for (auto& vertex : shape["hull"]) {
+                vertices.emplace_back(vertex["x"].get<float>(), vertex["y"].get<float>());
+            }
+        }
+
+        auto area = vertices.empty() ? 0.f : geom::getPolyArea(vertices);
+
+        writer.addShape(shape["x"].get<int32_t>(), shape["y"].get<int32_t>(), shape["width"].get<int32_t>(),
+            shape["height"].get<int32_t>(), reinterpret_cast<const float*>(vertices.data()),
+            static_cast<uint32_t>(vertices.size()), area);
     }
+}
 
-    auto quality = opts["optimize"].as<uint32_t>();
-    if (quality > 9) {
-        util::bail("Invalid quality level");
+bool parseFormat(const std::string& name, bool& outBinary) {
+    if (name == "json") {
+        outBinary = false;
+    } else if (name == "bin") {
+        outBinary = true;
+    } else {
+        return false;
     }
 
-    auto maxShapes = opts["max-shapes"].as<uint8_t>();
-    if (maxShapes == 0) {
-        util::bail("Invalid max shape count");
+    return true;
+}
+
+// Every option besides the input that a file's result depends on.
+std::string getSettingsKey(const geom::PolygonSettings& settings, uint32_t maxShapes, labeling::Overflow overflow,
+    uint8_t alphaThreshold, bool bExtra) {
+
+    std::ostringstream key;
+    key << "o" << settings.quality
+        << " v" << settings.vertexCount
+        << " c" << static_cast<int>(settings.candidates)
+        << " s" << static_cast<int>(settings.solver)
+        << " seed" << settings.seed
+        << " stall" << settings.stallIterations
+        << " eps" << std::hexfloat << settings.areaEpsilon << std::defaultfloat
+        << " budget" << settings.timeBudgetMs
+        << " pyr" << settings.pyramidSize
+        << " m" << maxShapes
+        << " ov" << static_cast<int>(overflow)
+        << " t" << static_cast<int>(alphaThreshold)
+        << " a" << bExtra;
+
+    return key.str();
+}
+
+// Key of a result in cache::Store.
+std::string getCacheKey(const ImageData& image, const std::string& settingsKey) {
+    std::ostringstream key;
+    key << std::hex << image.hashOpacityMask() << " " << settingsKey;
+
+    return key.str();
+}
+
+json getCacheStats(const cache::Store& store) {
+    return json({
+        { "hits", store.getHits() },
+        { "misses", store.getMisses() }
+    });
+}
+
+// An entry that doesn't parse counts as a miss; the result computed instead replaces it.
+bool loadCachedResult(cache::Store& store, const std::string& key, json& outResult) {
+    std::string cached;
+    if (!store.load(key, cached)) {
+        return false;
     }
 
-    auto bDebug = opts.count("debug") > 0;
-    auto bExtra = opts["analyze"].as<bool>();
+    outResult = json::parse(cached, nullptr, false);
+    if (outResult.is_discarded()) {
+        store.rejectHit();
+        outResult = json::object();
+        return false;
+    }
 
-    json result = {{ "shapes", json::array() }};
+    return true;
+}
 
-    auto numFound = image.findShapes(maxShapes);
-    if (numFound > 0) {
-        geom::Bounds<int> rectBounds = image.shapes[0].bounds;
-        geom::Bounds<float> hullBounds;
+// "out.png" becomes "out.3.png". Without an extension the index is appended.
+std::string getCropPath(const std::string& filePath, uint32_t index) {
+    auto dot = filePath.find_last_of('.');
+    auto separator = filePath.find_last_of("/\\");
 
-        for (auto& object : image.shapes) {
-            json shape = to_json(object.bounds);
-            std::vector<glm::vec2> vertices;
+    if (dot == std::string::npos || (separator != std::string::npos && dot < separator)) {
+        return filePath + "." + std::to_string(index);
+    }
 
-            if (geom::findEnclosingPolygon(image, object, quality, vertices)) {
-                shape["hull"] = json::array();
+    return filePath.substr(0, dot) + "." + std::to_string(index) + filePath.substr(dot);
+}
 
-                for (auto& vertex : vertices) {
-                    shape["hull"].push_back({
-                        { "x", vertex.x },
-                        { "y", vertex.y }
-                    });
+// One crop per shape of a debug image the polygons were drawn on, named after the file it came from.
+std::vector<debug::Crop> getDebugCrops(const ImageData& image, const std::string& name,
+    const std::vector<geom::Bounds<int>>& shapeBounds, const std::vector<std::vector<glm::vec2>>& polygons) {
 
-                    hullBounds.expand(vertex);
-                }
+    std::vector<debug::Crop> crops(polygons.size());
 
-                if (bDebug) {
-                    debug::drawPolygon(image, vertices);
-                }
+    for (auto i = 0u; i < polygons.size(); i++) {
+        crops[i].name = name;
+        crops[i].index = i;
+        debug::cropShape(image, shapeBounds[i], polygons[i], crops[i]);
+    }
 
-                if (bExtra) {
-                    shape["area"] = geom::getPolyArea(vertices);
-                }
-            } else {
-                shape["hull"] = nullptr;
+    return crops;
+}
+
+// Returns false if any of the crops couldn't be written.
+bool writeDebugCrops(const std::string& filePath, const std::vector<debug::Crop>& crops) {
+    auto bWritten = true;
+
+    for (auto& crop : crops) {
+        auto cropPath = getCropPath(filePath, crop.index);
+        bWritten &= png::write(cropPath.c_str(), crop.pixels, crop.width, crop.height, png::Compression::Fast);
+    }
+
+    return bWritten;
+}
+
+// Nothing is written when no shapes were found.
+bool writeContactSheet(const std::string& filePath, debug::ContactSheet& sheet) {
+    std::vector<uint8_t> pixels;
+    uint32_t width, height;
+    sheet.compose(pixels, width, height);
+
+    return width == 0 || png::write(filePath.c_str(), pixels, width, height, png::Compression::Fast);
+}
+
+int printResult(const cxxopts::ParseResult& opts, const std::string& path, const json& result, bool bBinary) {
+    if (bBinary) {
+        polyfile::Writer writer;
+
+        if (result.contains("cells")) {
+            // Each grid cell is stored as a file of its own, named after the image and the cell's column and row.
+            for (auto& cell : result["cells"]) {
+                auto cellPath = path + "#" + std::to_string(cell["column"].get<int>()) + "," +
+                    std::to_string(cell["row"].get<int>());
+                addBinaryFile(writer, cellPath, cell);
             }
+        } else {
+            addBinaryFile(writer, path, result);
+        }
+
+        std::string data;
+        if (!writer.serialize(data)) {
+            util::printError("Binary output is too large");
+            return 1;
+        }
 
-            result["shapes"].push_back(shape);
+        std::cout.write(data.data(), static_cast<std::streamsize>(data.size()));
+        return 0;
+    }
+
+    auto bPretty = opts["pretty"].as<bool>();
+
+    util::print(result.dump(bPretty ? 2 : -1));
+
+    return 0;
+}
+
+bool parseSize(const std::string& text, glm::ivec2& outSize) {
+    auto separator = text.find('x');
+    if (separator == std::string::npos) {
+        return false;
+    }
+
+    try {
+        size_t end;
+        outSize.x = std::stoi(text.substr(0, separator), &end);
+        if (end != separator) {
+            return false;
+        }
+
+        auto height = text.substr(separator + 1);
+        outSize.y = std::stoi(height, &end);
+        if (end != height.size()) {
+            return false;
+        }
+    } catch (const std::exception&) {
+        return false;
+    }
+
+    return outSize.x > 0 && outSize.y > 0;
+}
+
+struct ShapeResult {
+    json shape;
+    std::vector<glm::vec2> vertices;
+    geom::Bounds<float> hullBounds;
+};
+
+void setShapeResult(ShapeResult& shapeResult, const ImageShape& object, bool bFound, std::vector<glm::vec2>& vertices,
+    uint32_t iterations, bool bExtra) {
+
+    auto& shape = shapeResult.shape;
+    shape = to_json(object.bounds);
+    shapeResult.vertices = std::move(vertices);
+
+    if (bFound) {
+        shape["hull"] = json::array();
+
+        for (auto& vertex : shapeResult.vertices) {
+            shape["hull"].push_back({
+                { "x", vertex.x },
+                { "y", vertex.y }
+            });
+
+            shapeResult.hullBounds.expand(vertex);
+        }
+
+        if (bExtra) {
+            shape["area"] = geom::getPolyArea(shapeResult.vertices);
+            shape["iterations"] = iterations;
+        }
+    } else {
+        shape["hull"] = nullptr;
+    }
+}
+
+// Result object of an image, or of a single grid cell.
+json getImageResult(const std::vector<ImageShape>& shapes, std::vector<ShapeResult>& shapeResults, bool bExtra) {
+    json result = {{ "shapes", json::array() }};
+
+    if (!shapes.empty()) {
+        geom::Bounds<int> rectBounds = shapes[0].bounds;
+        geom::Bounds<float> hullBounds;
+
+        for (auto i = 0u; i < shapes.size(); i++) {
+            auto& object = shapes[i];
+            auto& shapeResult = shapeResults[i];
+
+            if (shapeResult.hullBounds.bValid) {
+                hullBounds.expand(shapeResult.hullBounds);
+            }
+
+            result["shapes"].push_back(std::move(shapeResult.shape));
 
             rectBounds.expand(object.bounds.min);
             rectBounds.expand(object.bounds.max);
@@ -100,27 +312,479 @@ int parseSingle(const cxxopts::ParseResult& opts) {
         result["hullBounds"] = nullptr;
     }
 
+    return result;
+}
+
+// Searches are large (candidates, corner tables, chunk results), so they are recycled across shapes and files.
+util::Pool<geom::PolygonSearch> gSearchPool;
+
+// Fits the enclosing polygon of a shape on the task pool. Chunks of the random search run as child tasks, `done` is
+// called with the result, the number of random search iterations used and whether the time budget stopped the search
+// once all of them finished.
+template<typename Task, typename Fn>
+void addPolygonTasks(Task& parent, const ImageData& image, const ImageShape& shape,
+    const geom::PolygonSettings& settings, uint32_t profileFile, Fn done) {
+
+    // Owned by the chain, which returns it to the pool in its last step.
+    auto search = gSearchPool.acquire().release();
+
+    tasks::chain(parent)
+        ->add([&image, &shape, &settings, search, profileFile](auto& task) { // image read only
+            {
+                profile::Scope scope("hull search", profileFile, shape.id);
+                geom::beginPolygonSearch(image, shape, settings, *search);
+            }
+
+            for (auto chunk = 0u; chunk < geom::getPolygonSearchChunks(*search); chunk++) {
+                tasks::add(task, [search, chunk, profileFile, shapeID = shape.id](auto&) {
+                    profile::Scope scope("random search", profileFile, shapeID);
+                    geom::runPolygonSearch(*search, chunk);
+                });
+            }
+        })
+        ->add([search, done](auto&) {
+            std::vector<glm::vec2> vertices;
+            auto bFound = geom::endPolygonSearch(*search, vertices);
+            auto iterations = geom::getPolygonSearchIterations(*search);
+            auto bTimedOut = geom::isPolygonSearchTimedOut(*search);
+            gSearchPool.release(std::unique_ptr<geom::PolygonSearch>(search));
+            done(bFound, vertices, iterations, bTimedOut);
+        })
+        ->submit();
+}
+
+// Settings of one analysis, from the command line or a server request, named like the command line options.
+struct AnalysisSettings {
+    geom::PolygonSettings polygonSettings;
+    uint32_t maxShapes = 255;
+    labeling::Method labelingMethod = labeling::Method::Runs;
+    labeling::Overflow overflow = labeling::Overflow::Merge;
+    uint8_t alphaThreshold = 0;
+    bool bExtra = false;
+};
+
+// Applies `options` on top of `settings`. Stops at the first invalid one, with the same message the command line gives.
+bool parseAnalysisOptions(const json& options, AnalysisSettings& settings, std::string& outError) {
+    if (!options.is_object()) {
+        outError = "Invalid options";
+        return false;
+    }
+
+    auto getUint = [](const json& value, uint32_t max, uint32_t& outValue) {
+        if (!value.is_number_unsigned() || value.get<uint64_t>() > max) {
+            return false;
+        }
+
+        outValue = value.get<uint32_t>();
+        return true;
+    };
+
+    auto& polygonSettings = settings.polygonSettings;
+
+    for (auto& [name, value] : options.items()) {
+        uint32_t number = 0;
+        auto bValid = true;
+
+        if (name == "optimize") {
+            bValid = getUint(value, 9, polygonSettings.quality);
+            outError = "Invalid quality level";
+        } else if (name == "vertices") {
+            bValid = getUint(value, 16, polygonSettings.vertexCount) && polygonSettings.vertexCount >= 3;
+            outError = "Invalid vertex count";
+        } else if (name == "hull-candidates") {
+            bValid = value.is_string() &&
+                geom::parseHullCandidates(value.get<std::string>(), polygonSettings.candidates);
+            outError = "Invalid hull candidate mode";
+        } else if (name == "solver") {
+            bValid = value.is_string() && geom::parsePolygonSolver(value.get<std::string>(), polygonSettings.solver);
+            outError = "Invalid polygon solver";
+        } else if (name == "seed") {
+            bValid = getUint(value, UINT32_MAX, polygonSettings.seed);
+            outError = "Invalid seed";
+        } else if (name == "stall-iterations") {
+            bValid = getUint(value, UINT32_MAX, polygonSettings.stallIterations);
+            outError = "Invalid stall iterations";
+        } else if (name == "shape-time-budget-ms") {
+            bValid = getUint(value, UINT32_MAX, polygonSettings.timeBudgetMs);
+            outError = "Invalid shape time budget";
+        } else if (name == "pyramid") {
+            bValid = getUint(value, UINT32_MAX, polygonSettings.pyramidSize) &&
+                (polygonSettings.pyramidSize == 0 || polygonSettings.pyramidSize >= 8);
+            outError = "Invalid pyramid size";
+        } else if (name == "area-epsilon") {
+            bValid = value.is_number() && value.get<float>() >= 0.f;
+            polygonSettings.areaEpsilon = bValid ? value.get<float>() : 0.f;
+            outError = "Invalid area epsilon";
+        } else if (name == "max-shapes") {
+            bValid = getUint(value, UINT32_MAX, settings.maxShapes) && settings.maxShapes > 0;
+            outError = "Invalid max shape count";
+        } else if (name == "labeling") {
+            bValid = value.is_string() && labeling::parseMethod(value.get<std::string>(), settings.labelingMethod);
+            outError = "Invalid labeling method";
+        } else if (name == "overflow") {
+            bValid = value.is_string() && labeling::parseOverflow(value.get<std::string>(), settings.overflow);
+            outError = "Invalid overflow policy";
+        } else if (name == "alpha-threshold") {
+            bValid = getUint(value, 254, number);
+            settings.alphaThreshold = static_cast<uint8_t>(number);
+            outError = "Invalid alpha threshold";
+        } else if (name == "analyze") {
+            bValid = value.is_boolean();
+            settings.bExtra = bValid && value.get<bool>();
+            outError = "Invalid analyze flag";
+        } else {
+            bValid = false;
+            outError = "Unknown option " + name;
+        }
+
+        if (!bValid) {
+            return false;
+        }
+    }
+
+    outError.clear();
+    return true;
+}
+
+// The command line options, validated the same way as those of a server request.
+AnalysisSettings parseAnalysisSettings(const cxxopts::ParseResult& opts) {
+    json options = {
+        { "optimize", opts["optimize"].as<uint32_t>() },
+        { "vertices", opts["vertices"].as<uint32_t>() },
+        { "hull-candidates", opts["hull-candidates"].as<std::string>() },
+        { "solver", opts["solver"].as<std::string>() },
+        { "seed", opts["seed"].as<uint32_t>() },
+        { "stall-iterations", opts["stall-iterations"].as<uint32_t>() },
+        { "shape-time-budget-ms", opts["shape-time-budget-ms"].as<uint32_t>() },
+        { "pyramid", opts["pyramid"].as<uint32_t>() },
+        { "area-epsilon", opts["area-epsilon"].as<float>() },
+        { "max-shapes", opts["max-shapes"].as<uint32_t>() },
+        { "labeling", opts["labeling"].as<std::string>() },
+        { "overflow", opts["overflow"].as<std::string>() },
+        { "alpha-threshold", opts["alpha-threshold"].as<uint8_t>() },
+        { "analyze", opts["analyze"].as<bool>() }
+    };
+
+    AnalysisSettings settings;
+    std::string error;
+    if (!parseAnalysisOptions(options, settings, error)) {
+        util::bail(error.c_str());
+    }
+
+    return settings;
+}
+
+int parseSingle(const cxxopts::ParseResult& opts) {
+    if (!opts.count("input")) {
+        util::bail("No input file specified");
+    }
+
+    auto inFile = opts["input"].as<std::string>();
+    auto profileFile = profile::addFile(inFile);
+
+    auto settings = parseAnalysisSettings(opts);
+    auto& polygonSettings = settings.polygonSettings;
+    auto maxShapes = settings.maxShapes;
+    auto labelingMethod = settings.labelingMethod;
+    auto overflow = settings.overflow;
+    auto alphaThreshold = settings.alphaThreshold;
+
+    auto workers = opts["threads"].as<uint32_t>();
+    if (workers < 1) {
+        util::bail("Invalid thread count");
+    }
+
+    bool bBinary;
+    if (!parseFormat(opts["format"].as<std::string>(), bBinary)) {
+        util::bail("Invalid output format");
+    }
+
+    // Sprite sheets can be sliced into cells, which are then analyzed as separate images.
+    glm::ivec2 gridSize(0);
+    glm::ivec2 cellSize(0);
+
+    if (opts.count("grid") && opts.count("cell-size")) {
+        util::bail("Only one of grid and cell size can be given");
+    }
+
+    if (opts.count("grid") && !parseSize(opts["grid"].as<std::string>(), gridSize)) {
+        util::bail("Invalid grid size");
+    }
+
+    if (opts.count("cell-size") && !parseSize(opts["cell-size"].as<std::string>(), cellSize)) {
+        util::bail("Invalid cell size");
+    }
+
+    auto bDebug = opts.count("debug") > 0;
+    auto bExtra = settings.bExtra;
+
+    debug::OutputMode debugMode;
+    if (!debug::parseOutputMode(opts["debug-mode"].as<std::string>(), debugMode)) {
+        util::bail("Invalid debug mode");
+    }
+
+    // Debug output needs the shapes to be analyzed again, so the cache is only used without it.
+    cache::Store cacheStore;
+    auto bCache = opts.count("cache-dir") > 0 && !bDebug;
+    if (bCache && !cacheStore.open(opts["cache-dir"].as<std::string>())) {
+        util::bail("Failed to open cache directory");
+    }
+
+    // The RGBA pixels are only decoded when the debug image is going to be drawn.
+    ImageData image;
+    {
+        profile::Scope scope("decode", profileFile);
+        if (!png::readMask(inFile.c_str(), image, alphaThreshold, bDebug)) {
+            util::bail("Failed to read PNG file");
+        }
+    }
+
+    // Partial cells at the right and bottom edges are ignored.
+    if (gridSize.x > 0) {
+        if (gridSize.x > image.width || gridSize.y > image.height) {
+            util::bail("Grid has more cells than the image has pixels");
+        }
+
+        cellSize = glm::ivec2(image.width / gridSize.x, image.height / gridSize.y);
+    }
+
+    auto bGrid = cellSize.x > 0;
+    auto columns = bGrid ? image.width / cellSize.x : 0;
+    auto rows = bGrid ? image.height / cellSize.y : 0;
+
+    if (bGrid && (columns == 0 || rows == 0)) {
+        util::bail("Grid cells are larger than the image");
+    }
+
+    std::string cacheKey;
+    if (bCache) {
+        auto settingsKey = getSettingsKey(polygonSettings, maxShapes, overflow, alphaThreshold, bExtra);
+        if (bGrid) {
+            settingsKey += " cell" + std::to_string(cellSize.x) + "x" + std::to_string(cellSize.y);
+        }
+
+        json result;
+        auto bCached = false;
+        {
+            profile::Scope scope("cache", profileFile);
+            cacheKey = getCacheKey(image, settingsKey);
+            bCached = loadCachedResult(cacheStore, cacheKey, result);
+        }
+
+        if (bCached) {
+            result["cache"] = getCacheStats(cacheStore);
+            return printResult(opts, inFile, result, bBinary);
+        }
+    }
+
+    // Set when a shape's search stopped at the time budget. Such results depend on timing and aren't cached.
+    std::atomic<bool> bTimedOut = false;
+
+    std::vector<labeling::RunLabeler> bands;
+    std::vector<ShapeResult> shapeResults;
+
+    // Views and results per cell in grid mode, in row-major order.
+    std::vector<ImageData> cells(columns * rows);
+    std::vector<std::vector<ShapeResult>> cellResults(cells.size());
+
+    tasks::init(workers);
+
+    auto root = tasks::add([&](auto& task) {
+        if (bGrid) {
+            for (auto i = 0u; i < cells.size(); i++) {
+                tasks::add(task, [&, i](auto& task) {
+                    auto& cell = cells[i];
+                    {
+                        profile::Scope scope("labeling", profileFile);
+                        cell = image.createView((i % columns) * cellSize.x, (i / columns) * cellSize.y, cellSize.x,
+                            cellSize.y);
+                        cell.findShapes(maxShapes, labelingMethod, overflow);
+                        cellResults[i].resize(cell.shapes.size());
+                    }
+
+                    for (auto j = 0u; j < cell.shapes.size(); j++) {
+                        addPolygonTasks(task, cell, cell.shapes[j], polygonSettings, profileFile,
+                            [&, i, j](bool bFound, std::vector<glm::vec2>& vertices, uint32_t iterations,
+                                bool bShapeTimedOut) {
+                                if (bShapeTimedOut) {
+                                    bTimedOut = true;
+                                }
+
+                                profile::Scope scope("json", profileFile, cells[i].shapes[j].id);
+                                setShapeResult(cellResults[i][j], cells[i].shapes[j], bFound, vertices, iterations,
+                                    bExtra);
+                            });
+                    }
+                });
+            }
+
+            return;
+        }
+
+        tasks::chain(task)
+            ->add([&](auto& task) { // label horizontal bands
+                if (labelingMethod != labeling::Method::Runs) {
+                    profile::Scope scope("labeling", profileFile);
+                    image.findShapes(maxShapes, labelingMethod, overflow);
+                    return;
+                }
+
+                auto numBands = std::clamp(image.height / gMinBandHeight, 1, static_cast<int>(workers));
+                bands.resize(numBands);
+
+                for (auto i = 0; i < numBands; i++) {
+                    tasks::add(task, [&, i, numBands](auto&) {
+                        profile::Scope scope("labeling", profileFile);
+                        auto beginY = image.height * i / numBands;
+                        auto endY = image.height * (i + 1) / numBands;
+                        image.extractRuns(beginY, endY, bands[i]);
+                    });
+                }
+            })
+            ->add([&](auto& task) { // stitch band seams, then fit polygons per shape
+                if (!bands.empty()) {
+                    profile::Scope scope("stitch", profileFile);
+
+                    for (auto i = 1u; i < bands.size(); i++) {
+                        bands[0].merge(bands[i]);
+                    }
+
+                    image.assignShapes(bands[0], maxShapes, overflow);
+                    bands.clear();
+                }
+
+                shapeResults.resize(image.shapes.size());
+
+                for (auto i = 0u; i < image.shapes.size(); i++) {
+                    addPolygonTasks(task, image, image.shapes[i], polygonSettings, profileFile,
+                        [&, i](bool bFound, std::vector<glm::vec2>& vertices, uint32_t iterations,
+                            bool bShapeTimedOut) {
+                            if (bShapeTimedOut) {
+                                bTimedOut = true;
+                            }
+
+                            profile::Scope scope("json", profileFile, image.shapes[i].id);
+                            setShapeResult(shapeResults[i], image.shapes[i], bFound, vertices, iterations, bExtra);
+                        });
+                }
+            })
+            ->submit();
+    });
+
+    tasks::wait(root);
+    tasks::shutdown();
+
+    json result;
+    // Drawn together once the results are collected, so the debug image is walked only once.
+    std::vector<std::vector<glm::vec2>> debugPolygons;
+    std::vector<geom::Bounds<int>> debugBounds;
+
+    if (bGrid) {
+        result = {
+            { "cellSize", {{ "width", cellSize.x }, { "height", cellSize.y }} },
+            { "cells", json::array() }
+        };
+
+        for (auto i = 0u; i < cells.size(); i++) {
+            auto origin = glm::ivec2((i % columns) * cellSize.x, (i / columns) * cellSize.y);
+
+            if (bDebug) {
+                for (auto j = 0u; j < cellResults[i].size(); j++) {
+                    for (auto& vertex : cellResults[i][j].vertices) {
+                        vertex += glm::vec2(origin);
+                    }
+
+                    auto bounds = cells[i].shapes[j].bounds;
+                    bounds.min += origin;
+                    bounds.max += origin;
+
+                    debugPolygons.push_back(std::move(cellResults[i][j].vertices));
+                    debugBounds.push_back(bounds);
+                }
+            }
+
+            profile::Scope scope("json", profileFile);
+
+            auto cellResult = getImageResult(cells[i].shapes, cellResults[i], bExtra);
+            cellResult["column"] = i % columns;
+            cellResult["row"] = i / columns;
+            cellResult["x"] = origin.x;
+            cellResult["y"] = origin.y;
+
+            result["cells"].push_back(std::move(cellResult));
+        }
+    } else {
+        if (bDebug) {
+            for (auto i = 0u; i < shapeResults.size(); i++) {
+                debugPolygons.push_back(std::move(shapeResults[i].vertices));
+                debugBounds.push_back(image.shapes[i].bounds);
+            }
+        }
+
+        profile::Scope scope("json", profileFile);
+        result = getImageResult(image.shapes, shapeResults, bExtra);
+    }
+
+    if (bDebug) {
+        profile::Scope scope("debug draw", profileFile);
+        debug::drawPolygons(image, debugPolygons);
+    }
+
     if (bDebug) {
+        profile::Scope scope("debug png", profileFile);
+
         auto outFile = opts["debug"].as<std::string>();
-        if (!png::write(outFile.c_str(), image)) {
+        auto bWritten = true;
+
+        if (debugMode == debug::OutputMode::Full) {
+            bWritten = png::write(outFile.c_str(), image, png::Compression::Fast);
+        } else {
+            auto crops = getDebugCrops(image, inFile, debugBounds, debugPolygons);
+
+            if (debugMode == debug::OutputMode::Crops) {
+                bWritten = writeDebugCrops(outFile, crops);
+            } else {
+                debug::ContactSheet sheet;
+                for (auto& crop : crops) {
+                    sheet.add(std::move(crop));
+                }
+
+                bWritten = writeContactSheet(outFile, sheet);
+            }
+        }
+
+        if (!bWritten) {
             util::bail("Failed to write debug PNG file");
         }
     }
 
-    auto bPretty = opts["pretty"].as<bool>();
+    if (bCache) {
+        profile::Scope scope("cache", profileFile);
 
-    util::print(result.dump(bPretty ? 2 : -1));
+        if (!bTimedOut) {
+            cacheStore.store(cacheKey, result.dump());
+        }
 
-    return 0;
+        result["cache"] = getCacheStats(cacheStore);
+    }
+
+    profile::Scope scope("output", profileFile);
+    return printResult(opts, inFile, result, bBinary);
 }
 
 int parseMultiple(const cxxopts::ParseResult& opts) {
     struct TaskContext {
-        std::mutex writeMutex;
         std::string fileName;
-        ImageData image;
-        geom::Bounds<int> rectBounds;
-        geom::Bounds<float> hullBounds;
+        uint32_t profileFile = profile::gNone;
+        std::shared_ptr<io::FileData> file;
+        // Set when the result is to be added to the cache once it's complete.
+        std::string cacheKey;
+        // Set when a shape's search stopped at the time budget, which keeps the result out of the cache.
+        std::atomic<bool> bTimedOut = false;
+        bool bReadError = false;
+        // Taken from the image pool, so the pixel, mask and label buffers of earlier files are reused.
+        std::unique_ptr<ImageData> image;
+        std::vector<ShapeResult> shapeResults;
         json result;
         std::vector<std::vector<glm::vec2>> debugShapes;
     };
@@ -130,125 +794,275 @@ int parseMultiple(const cxxopts::ParseResult& opts) {
         util::bail("Invalid thread count");
     }
 
-    auto quality = opts["optimize"].as<uint32_t>();
-    if (quality > 9) {
-        util::bail("Invalid quality level");
+    auto settings = parseAnalysisSettings(opts);
+    auto& polygonSettings = settings.polygonSettings;
+    auto maxShapes = settings.maxShapes;
+    auto labelingMethod = settings.labelingMethod;
+    auto overflow = settings.overflow;
+    auto alphaThreshold = settings.alphaThreshold;
+
+    auto prefetchDepth = opts["prefetch"].as<uint32_t>();
+    if (prefetchDepth < 1) {
+        util::bail("Invalid prefetch depth");
+    }
+
+    bool bBinary;
+    if (!parseFormat(opts["format"].as<std::string>(), bBinary)) {
+        util::bail("Invalid output format");
     }
 
-    auto maxShapes = opts["max-shapes"].as<uint8_t>();
-    if (maxShapes == 0) {
-        util::bail("Invalid max shape count");
+    if (opts.count("grid") || opts.count("cell-size")) {
+        util::bail("Grid slicing is only supported for single images");
+    }
+
+    // With --ndjson every file's result is written as its own line as soon as it is done, instead of being collected.
+    auto bNdjson = opts["ndjson"].as<bool>();
+    if (bNdjson && bBinary) {
+        util::bail("NDJSON output requires the JSON format");
     }
 
     auto bDebug = opts.count("debug") > 0;
-    auto bExtra = opts["analyze"].as<bool>();
+    auto bExtra = settings.bExtra;
+
+    debug::OutputMode debugMode;
+    if (!debug::parseOutputMode(opts["debug-mode"].as<std::string>(), debugMode)) {
+        util::bail("Invalid debug mode");
+    }
     auto pattern = opts["files"].as<std::string>();
 
-    tasks::init(workers);
+    // Debug output needs the shapes to be analyzed again, so the cache is only used without it.
+    cache::Store cacheStore;
+    auto bCache = opts.count("cache-dir") > 0 && !bDebug;
+    if (bCache && !cacheStore.open(opts["cache-dir"].as<std::string>())) {
+        util::bail("Failed to open cache directory");
+    }
+
+    auto settingsKey = getSettingsKey(polygonSettings, maxShapes, overflow, alphaThreshold, bExtra);
+
+    util::LineWriter writer;
 
     json output = {{ "files", json::array() }};
+    std::mutex outputMutex;
+
+    // Called concurrently as files finish.
+    auto addResult = [&](json result) {
+        if (bNdjson) {
+            writer.write(result.dump());
+        } else {
+            std::lock_guard lg(outputMutex);
+            output["files"].push_back(std::move(result));
+        }
+    };
+
+    // With --incremental, files whose size and modification time match the manifest of the previous run aren't read
+    // at all. Debug output needs every file to be analyzed, so the previous manifest is ignored then.
+    auto bIncremental = opts.count("incremental") > 0;
+    manifest::Manifest previous(cache::getVersionedKey(settingsKey));
+    manifest::Manifest current(cache::getVersionedKey(settingsKey));
+    std::unordered_map<std::string, manifest::Stamp> stamps;
+    uint32_t numReused = 0;
+    uint32_t numKnown = 0;
+
+    if (bIncremental && !bDebug) {
+        previous.load(opts["incremental"].as<std::string>());
+    }
+
+    std::vector<std::string> filePaths;
+    for (auto& inFile : glob::glob(pattern)) {
+        auto filePath = inFile.string();
+
+        manifest::Stamp stamp;
+        if (bIncremental && manifest::getStamp(filePath, stamp)) {
+            numKnown += previous.contains(filePath);
+
+            if (auto previousResult = previous.find(filePath, stamp)) {
+                current.set(filePath, stamp, *previousResult);
+
+                auto result = *previousResult;
+                result["path"] = filePath;
+                addResult(std::move(result));
+
+                numReused++;
+                continue;
+            }
+
+            stamps[filePath] = stamp;
+        }
+
+        filePaths.emplace_back(std::move(filePath));
+    }
+
+    auto numAnalyzed = static_cast<uint32_t>(filePaths.size());
+
+    // Files are read on the prefetcher's own threads; the workers only decode them from memory.
+    io::Prefetcher prefetcher(std::move(filePaths), prefetchDepth);
+    util::Pool<ImageData> imagePool;
+
+    // Debug images are encoded on their own thread, so the workers move on to the next file right away. Declared
+    // after everything the jobs refer to, so they are finished first.
+    debug::ContactSheet debugSheet;
+    io::OutputQueue debugQueue(prefetchDepth);
+
+    // Takes what the output needs from the context; the image itself goes back to the pool.
+    auto queueDebugOutput = [&](TaskContext& ctx) {
+        auto outFile = ctx.fileName + opts["debug"].as<std::string>();
+
+        if (debugMode == debug::OutputMode::Full) {
+            // The pixels move to the job, only the mask and label buffers are reused by the next file.
+            debugQueue.submit([outFile, width = ctx.image->width, height = ctx.image->height,
+                pixels = std::move(ctx.image->rawData), profileFile = ctx.profileFile] {
+
+                profile::Scope scope("debug png", profileFile);
+                if (!png::write(outFile.c_str(), pixels, width, height, png::Compression::Fast)) {
+                    util::printError("Failed to write debug PNG file ", outFile);
+                }
+            });
+
+            return;
+        }
+
+        std::vector<geom::Bounds<int>> shapeBounds;
+        for (auto& shape : ctx.image->shapes) {
+            shapeBounds.push_back(shape.bounds);
+        }
+
+        auto crops = getDebugCrops(*ctx.image, ctx.fileName, shapeBounds, ctx.debugShapes);
+
+        if (debugMode == debug::OutputMode::Sheet) {
+            for (auto& crop : crops) {
+                debugSheet.add(std::move(crop));
+            }
+
+            return;
+        }
+
+        debugQueue.submit([outFile, crops = std::move(crops), profileFile = ctx.profileFile] {
+            profile::Scope scope("debug png", profileFile);
+            if (!writeDebugCrops(outFile, crops)) {
+                util::printError("Failed to write debug PNG files for ", outFile);
+            }
+        });
+    };
+
+    // One extra worker for the root task, which spends its time waiting for the prefetcher.
+    tasks::init(workers + 1);
 
     auto root = tasks::add([&](auto& task) {
-        for (auto& inFile : glob::glob(pattern)) {
+        std::string fileName;
+        std::shared_ptr<io::FileData> file;
+
+        while (prefetcher.next(fileName, file)) {
             auto ctx = std::make_shared<TaskContext>();
-            ctx->fileName = std::move(inFile.string());
+            ctx->fileName = std::move(fileName);
+            ctx->profileFile = profile::addFile(ctx->fileName);
+            ctx->file = std::move(file);
 
             tasks::chain(task)
                 ->add([&, ctx](auto& task) {
-                    if (!png::read(ctx->fileName.c_str(), ctx->image)) {
+                    ctx->image = imagePool.acquire();
+
+                    auto bDecoded = false;
+                    {
+                        profile::Scope scope("decode", ctx->profileFile);
+                        bDecoded = ctx->file &&
+                            png::decodeMask(ctx->file->data(), ctx->file->size(), *ctx->image, alphaThreshold, bDebug);
+                    }
+
+                    // Frees the prefetch slot for the next file.
+                    ctx->file.reset();
+
+                    if (!bDecoded) {
                         ctx->result["error"] = "Failed to read PNG file";
+                        ctx->bReadError = true;
                         return;
                     }
 
-                    auto numFound = ctx->image.findShapes(maxShapes);
-                    if (numFound > 0) {
-                        ctx->result["shapes"] = json::array();
-
-                        tasks::chain(task)
-                            ->add([&, ctx](auto& task) { // image read only
-                                ctx->rectBounds = ctx->image.shapes[0].bounds;
-
-                                for (auto i = 0u; i < ctx->image.shapes.size(); i++) {
-                                    tasks::add(task, [&, ctx, i](auto&) {
-                                        const auto& object = ctx->image.shapes[i];
-                                        json shape = to_json(object.bounds);
-                                        std::vector<glm::vec2> vertices;
-                                        geom::Bounds<float> tmpHullBounds;
-                                        auto bFound = geom::findEnclosingPolygon(ctx->image, object, quality, vertices);
-
-                                        if (bFound) {
-                                            shape["hull"] = json::array();
-
-                                            for (auto& vertex : vertices) {
-                                                shape["hull"].push_back({
-                                                    { "x", vertex.x },
-                                                    { "y", vertex.y }
-                                                });
-
-                                                tmpHullBounds.expand(vertex);
-                                            }
-
-                                            if (bExtra) {
-                                                shape["area"] = geom::getPolyArea(vertices);
-                                            }
-                                        } else {
-                                            shape["hull"] = nullptr;
-                                        }
+                    if (bCache) {
+                        profile::Scope scope("cache", ctx->profileFile);
+                        auto cacheKey = getCacheKey(*ctx->image, settingsKey);
 
-                                        {
-                                            // write results
-                                            std::lock_guard lg(ctx->writeMutex);
+                        if (loadCachedResult(cacheStore, cacheKey, ctx->result)) {
+                            return;
+                        }
 
-                                            ctx->result["shapes"].push_back(shape);
+                        ctx->cacheKey = std::move(cacheKey);
+                    }
 
-                                            if (tmpHullBounds.bValid) {
-                                                ctx->hullBounds.expand(tmpHullBounds);
-                                            }
+                    {
+                        profile::Scope scope("labeling", ctx->profileFile);
+                        ctx->image->findShapes(maxShapes, labelingMethod, overflow);
+                    }
 
-                                            ctx->rectBounds.expand(object.bounds.min);
-                                            ctx->rectBounds.expand(object.bounds.max);
+                    // Results are collected per shape and assembled in shape order, so the output doesn't depend
+                    // on which search finishes first.
+                    ctx->shapeResults.resize(ctx->image->shapes.size());
 
-                                            if (bDebug) {
-                                                ctx->debugShapes.emplace_back(std::move(vertices));
-                                            }
+                    tasks::chain(task)
+                        ->add([&, ctx](auto& task) { // image read only
+                            for (auto i = 0u; i < ctx->image->shapes.size(); i++) {
+                                addPolygonTasks(task, *ctx->image, ctx->image->shapes[i], polygonSettings,
+                                    ctx->profileFile,
+                                    [&, ctx, i](bool bFound, std::vector<glm::vec2>& vertices, uint32_t iterations,
+                                        bool bShapeTimedOut) {
+                                        if (bShapeTimedOut) {
+                                            ctx->bTimedOut = true;
                                         }
+
+                                        auto& object = ctx->image->shapes[i];
+                                        profile::Scope scope("json", ctx->profileFile, object.id);
+                                        setShapeResult(ctx->shapeResults[i], object, bFound, vertices, iterations,
+                                            bExtra);
                                     });
-                                }
-                            })
-                            ->add([&, ctx](auto&) { // image write
-                                if (bExtra) {
-                                    ctx->result["rectBounds"] = to_json(ctx->rectBounds);
-
-                                    if (ctx->hullBounds.bValid) {
-                                        ctx->result["hullBounds"] = to_json(ctx->hullBounds);
-                                    } else {
-                                        ctx->result["hullBounds"] = nullptr;
-                                    }
-                                }
+                            }
+                        })
+                        ->add([&, ctx](auto&) { // image write
+                            ctx->result = getImageResult(ctx->image->shapes, ctx->shapeResults, bExtra);
+
+                            if (bExtra && ctx->image->shapes.empty()) {
+                                ctx->result["error"] = "No shapes found";
+                            }
 
-                                if (bDebug) {
-                                    for (auto& vertices : ctx->debugShapes) {
-                                        debug::drawPolygon(ctx->image, vertices);
-                                    }
+                            if (bDebug) {
+                                profile::Scope scope("debug draw", ctx->profileFile);
+
+                                for (auto& shapeResult : ctx->shapeResults) {
+                                    ctx->debugShapes.push_back(std::move(shapeResult.vertices));
                                 }
-                            })
-                            ->submit();
-                    } else if (bExtra) {
-                        ctx->result["error"] = "No shapes found";
-                        ctx->result["rectBounds"] = nullptr;
-                        ctx->result["hullBounds"] = nullptr;
-                    }
+
+                                debug::drawPolygons(*ctx->image, ctx->debugShapes);
+                            }
+
+                            ctx->shapeResults.clear();
+                        })
+                        ->submit();
                 })
                 ->add([&, ctx](auto&) {
-                    ctx->result["path"] = ctx->fileName;
-                    output["files"].push_back(ctx->result);
+                    if (!ctx->cacheKey.empty() && !ctx->bTimedOut) {
+                        profile::Scope scope("cache", ctx->profileFile);
+                        cacheStore.store(ctx->cacheKey, ctx->result.dump());
+                    }
 
-                    if (bDebug) {
-                        auto sOutFile = ctx->fileName + opts["debug"].as<std::string>();
-                        if (!png::write(sOutFile.c_str(), ctx->image)) {
-                            // @TODO Do what exactly?
-                        }
+                    // Read errors are retried on the next run, even if the file doesn't change.
+                    auto stamp = stamps.find(ctx->fileName);
+                    if (stamp != stamps.end() && !ctx->bReadError) {
+                        std::lock_guard lg(outputMutex);
+                        current.set(ctx->fileName, stamp->second, ctx->result);
+                    }
+
+                    {
+                        profile::Scope scope("output", ctx->profileFile);
+                        ctx->result["path"] = ctx->fileName;
+                        addResult(std::move(ctx->result));
+                        ctx->result = nullptr;
                     }
+
+                    // A pooled image still holds the pixels of an earlier file when decoding failed.
+                    if (bDebug && !ctx->bReadError) {
+                        queueDebugOutput(*ctx);
+                    }
+
+                    // Nothing refers to the image past this point, hand it to the next file.
+                    imagePool.release(std::move(ctx->image));
                 })
                 ->submit();
         }
@@ -257,9 +1071,345 @@ int parseMultiple(const cxxopts::ParseResult& opts) {
     tasks::wait(root);
     tasks::shutdown();
 
+    if (bDebug && debugMode == debug::OutputMode::Sheet) {
+        profile::Scope scope("debug png");
+        if (!writeContactSheet(opts["debug"].as<std::string>(), debugSheet)) {
+            util::printError("Failed to write debug PNG file");
+        }
+    }
+
+    profile::Scope scope("output");
+
+    json stats = json::object();
+
+    if (bCache) {
+        stats["cache"] = getCacheStats(cacheStore);
+    }
+
+    if (bIncremental) {
+        if (!current.save(opts["incremental"].as<std::string>())) {
+            util::printError("Failed to write manifest");
+        }
+
+        stats["incremental"] = {
+            { "reused", numReused },
+            { "analyzed", numAnalyzed },
+            { "removed", previous.size() - numKnown }
+        };
+    }
+
+    if (bNdjson) {
+        if (!stats.empty()) {
+            writer.write(stats.dump());
+        }
+
+        writer.flush();
+        return 0;
+    }
+
+    output.update(stats);
+
+    if (bBinary) {
+        polyfile::Writer binaryWriter;
+        for (auto& file : output["files"]) {
+            addBinaryFile(binaryWriter, file["path"].get<std::string>(), file);
+        }
+
+        std::string data;
+        if (!binaryWriter.serialize(data)) {
+            util::printError("Binary output is too large");
+            return 1;
+        }
+
+        std::cout.write(data.data(), static_cast<std::streamsize>(data.size()));
+        return 0;
+    }
+
     auto bPretty = opts["pretty"].as<bool>();
 
     util::print(output.dump(bPretty ? 2 : -1));
 
+    return 0;
+}
+
+int parseServe(const cxxopts::ParseResult& opts) {
+    // One request, and its result once it's analyzed.
+    struct Request {
+        std::shared_ptr<io::Stream> stream;
+        json id;
+        std::string path;
+        uint32_t profileFile = profile::gNone;
+        // Set up front for PNG data sent with the request, opened by the worker for a path.
+        std::shared_ptr<io::FileData> file;
+        AnalysisSettings settings;
+        std::unique_ptr<ImageData> image;
+        std::vector<ShapeResult> shapeResults;
+        json result;
+    };
+
+    auto workers = opts["threads"].as<uint32_t>();
+    if (workers < 1) {
+        util::bail("Invalid thread count");
+    }
+
+    if (opts.count("debug") || opts.count("grid") || opts.count("cell-size") || opts.count("cache-dir") ||
+        opts.count("incremental")) {
+        util::bail("Debug output, grid slicing and caching are not supported by the server");
+    }
+
+    if (opts["format"].as<std::string>() != "json") {
+        util::bail("The server only writes JSON");
+    }
+
+    // A socket server runs until it's killed, so the trace would never be written while its spans keep piling up.
+    if (opts.count("profile") && opts["serve"].as<std::string>() != "-") {
+        util::bail("Profiling is only supported when serving standard input");
+    }
+
+    // The command line options are the defaults of every request.
+    auto defaultSettings = parseAnalysisSettings(opts);
+
+    // Filled by the clients, drained by the root task. Bounded, so a client sending faster than the workers keep up
+    // waits instead of queueing up images.
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::deque<std::shared_ptr<Request>> queue;
+    auto queueCapacity = workers * 4;
+    auto bClosed = false;
+
+    auto respond = [](io::Stream& stream, const json& id, json result) {
+        result["id"] = id;
+        // A client that disconnected doesn't get its results, the others aren't affected.
+        stream.write(result.dump() + "\n");
+    };
+
+    // Reads the requests of one client until it disconnects. A request is a line of JSON, followed by `size` bytes of
+    // PNG data when it doesn't name a file by `path`.
+    auto readRequests = [&](const std::shared_ptr<io::Stream>& stream) {
+        std::string line;
+        std::string error;
+
+        while (stream->readLine(line)) {
+            if (line.empty()) {
+                continue;
+            }
+
+            // Without a valid header there's no telling where the next request starts.
+            auto header = json::parse(line, nullptr, false);
+            if (!header.is_object()) {
+                respond(*stream, nullptr, {{ "error", "Invalid request" }});
+                return;
+            }
+
+            auto request = std::make_shared<Request>();
+            request->stream = stream;
+            request->id = header.contains("id") ? header["id"] : json();
+
+            if (header.contains("size")) {
+                auto& size = header["size"];
+                if (!size.is_number_unsigned() || size.get<uint64_t>() > gMaxRequestSize) {
+                    respond(*stream, request->id, {{ "error", "Invalid request size" }});
+                    return;
+                }
+
+                std::vector<uint8_t> data(size.get<size_t>());
+                if (!stream->read(data.data(), data.size())) {
+                    return;
+                }
+
+                request->file = std::make_shared<io::FileData>(std::move(data));
+            } else if (header.contains("path") && header["path"].is_string()) {
+                request->path = header["path"].get<std::string>();
+            } else {
+                respond(*stream, request->id, {{ "error", "No input file specified" }});
+                continue;
+            }
+
+            request->settings = defaultSettings;
+            if (header.contains("options") && !parseAnalysisOptions(header["options"], request->settings, error)) {
+                respond(*stream, request->id, {{ "error", error }});
+                continue;
+            }
+
+            request->profileFile = profile::addFile(request->path.empty() ? "-" : request->path);
+
+            {
+                std::unique_lock lock(queueMutex);
+                queueChanged.wait(lock, [&] { return queue.size() < queueCapacity; });
+                queue.push_back(std::move(request));
+            }
+
+            queueChanged.notify_all();
+        }
+    };
+
+    // Before the pool is started, so a failure can still bail.
+    auto socketPath = opts["serve"].as<std::string>();
+    auto listener = -1;
+
+    if (socketPath != "-") {
+        listener = io::listenUnix(socketPath);
+        if (listener < 0) {
+            util::bail("Failed to listen on socket");
+        }
+    }
+
+    // Lives as long as the server, so every request reuses the buffers of earlier ones.
+    util::Pool<ImageData> imagePool;
+
+    // One extra worker for the root task, which spends its time waiting for requests.
+    tasks::init(workers + 1);
+
+    auto root = tasks::add([&](auto& task) {
+        while (true) {
+            std::shared_ptr<Request> request;
+
+            {
+                std::unique_lock lock(queueMutex);
+                queueChanged.wait(lock, [&] { return bClosed || !queue.empty(); });
+
+                if (queue.empty()) {
+                    return;
+                }
+
+                request = std::move(queue.front());
+                queue.pop_front();
+            }
+
+            queueChanged.notify_all();
+
+            tasks::chain(task)
+                ->add([&, request](auto& task) {
+                    auto& settings = request->settings;
+                    request->image = imagePool.acquire();
+
+                    auto bDecoded = false;
+                    {
+                        profile::Scope scope("decode", request->profileFile);
+
+                        if (!request->file) {
+                            request->file = std::make_shared<io::FileData>();
+                            if (!request->file->open(request->path.c_str())) {
+                                request->file.reset();
+                            }
+                        }
+
+                        bDecoded = request->file && png::decodeMask(request->file->data(), request->file->size(),
+                            *request->image, settings.alphaThreshold, false);
+                    }
+
+                    request->file.reset();
+
+                    if (!bDecoded) {
+                        request->result = {{ "error", "Failed to read PNG file" }};
+                        return;
+                    }
+
+                    {
+                        profile::Scope scope("labeling", request->profileFile);
+                        request->image->findShapes(settings.maxShapes, settings.labelingMethod, settings.overflow);
+                    }
+
+                    auto& shapes = request->image->shapes;
+                    request->shapeResults.resize(shapes.size());
+
+                    for (auto i = 0u; i < shapes.size(); i++) {
+                        addPolygonTasks(task, *request->image, shapes[i], settings.polygonSettings,
+                            request->profileFile,
+                            [request, i](bool bFound, std::vector<glm::vec2>& vertices, uint32_t iterations, bool) {
+                                auto& object = request->image->shapes[i];
+                                profile::Scope scope("json", request->profileFile, object.id);
+                                setShapeResult(request->shapeResults[i], object, bFound, vertices, iterations,
+                                    request->settings.bExtra);
+                            });
+                    }
+                })
+                ->add([&, request](auto&) {
+                    profile::Scope scope("output", request->profileFile);
+
+                    if (request->result.is_null()) {
+                        auto bExtra = request->settings.bExtra;
+                        request->result = getImageResult(request->image->shapes, request->shapeResults, bExtra);
+
+                        if (bExtra && request->image->shapes.empty()) {
+                            request->result["error"] = "No shapes found";
+                        }
+                    }
+
+                    if (!request->path.empty()) {
+                        request->result["path"] = request->path;
+                    }
+
+                    respond(*request->stream, request->id, std::move(request->result));
+
+                    imagePool.release(std::move(request->image));
+                })
+                ->submit();
+        }
+    });
+
+    if (listener < 0) {
+        readRequests(std::make_shared<io::Stream>(0, 1, false));
+    } else {
+        // Runs until the process is stopped. Each client is read on a thread of its own, its results are written by
+        // whichever worker finishes them.
+        std::mutex connectionMutex;
+        std::condition_variable connectionClosed;
+        uint32_t numConnections = 0;
+        auto acceptDelay = gMinAcceptDelay;
+
+        while (true) {
+            {
+                std::unique_lock lock(connectionMutex);
+                connectionClosed.wait(lock, [&] { return numConnections < gMaxConnections; });
+                numConnections++;
+            }
+
+            auto bRetry = false;
+            auto fd = io::acceptConnection(listener, bRetry);
+
+            // Connections that close free descriptors again, only a broken listener ends the server.
+            if (fd < 0 && bRetry) {
+                util::printError("Failed to accept connection: ", std::strerror(errno), ", retrying");
+
+                {
+                    std::lock_guard lock(connectionMutex);
+                    numConnections--;
+                }
+
+                std::this_thread::sleep_for(acceptDelay);
+                acceptDelay = std::min(acceptDelay * 2, gMaxAcceptDelay);
+                continue;
+            }
+
+            if (fd < 0) {
+                util::bail("Failed to accept connection");
+            }
+
+            acceptDelay = gMinAcceptDelay;
+
+            std::thread([&, fd] {
+                readRequests(std::make_shared<io::Stream>(fd, fd, true));
+
+                {
+                    std::lock_guard lock(connectionMutex);
+                    numConnections--;
+                }
+
+                connectionClosed.notify_one();
+            }).detach();
+        }
+    }
+
+    {
+        std::lock_guard lock(queueMutex);
+        bClosed = true;
+    }
+
+    queueChanged.notify_all();
+
+    tasks::wait(root);
+    tasks::shutdown();
+
     return 0;
 }
\ No newline at end of file
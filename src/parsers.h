@@ -4,3 +4,5 @@
 
 int parseSingle(const cxxopts::ParseResult& opts);
 int parseMultiple(const cxxopts::ParseResult& opts);
+// Analyzes requests from a Unix domain socket, or standard input with "-", until it is stopped or the input ends.
+int parseServe(const cxxopts::ParseResult& opts);
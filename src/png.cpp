@@ -1,7 +1,276 @@
+#include <cstring>
+#include <algorithm>
+#include <array>
+#include <new>
+#include <stdexcept>
 #include "png.h"
+#include "inflate.h"
+#include "io.h"
+
+const uint8_t gSignature[] { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+// Checked against the header before anything is allocated, a few bytes of IHDR must not commit gigabytes. lodepng
+// has the same kind of limits.
+const uint64_t gMaxPixels = 1ull << 28;
+const uint64_t gMaxRowSize = 1ull << 27;
+
+struct Header {
+    uint32_t width = 0;
+    uint32_t height = 0;
+    uint8_t bitDepth = 0;
+    uint8_t colorType = 0;
+    uint8_t interlace = 0;
+
+    // Per pixel alpha for palette images and the transparent color key for grey and RGB ones.
+    uint8_t paletteAlpha[256];
+    uint16_t key[3] {};
+    bool bKey = false;
+
+    int getChannels() const {
+        switch (colorType) {
+            case 0: return 1;
+            case 2: return 3;
+            case 3: return 1;
+            case 4: return 2;
+            case 6: return 4;
+        }
+
+        return 0;
+    }
+
+    bool isValid() const {
+        auto bValidDepth = false;
+        switch (colorType) {
+            case 0: bValidDepth = bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8 || bitDepth == 16; break;
+            case 3: bValidDepth = bitDepth == 1 || bitDepth == 2 || bitDepth == 4 || bitDepth == 8; break;
+            case 2:
+            case 4:
+            case 6: bValidDepth = bitDepth == 8 || bitDepth == 16; break;
+        }
+
+        if (!bValidDepth || width == 0 || height == 0 || width >= (1u << 30) || height >= (1u << 30) || interlace > 1) {
+            return false;
+        }
+
+        auto rowSize = (static_cast<uint64_t>(width) * getChannels() * bitDepth + 7) / 8;
+        return static_cast<uint64_t>(width) * height <= gMaxPixels && rowSize <= gMaxRowSize;
+    }
+};
+
+uint32_t readUint32(const uint8_t* data) {
+    return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+}
+
+uint16_t readUint16(const uint8_t* data) {
+    return static_cast<uint16_t>((data[0] << 8) | data[1]);
+}
+
+// CRC-32 of a chunk's type and data, as stored after them.
+uint32_t getChunkCrc(const uint8_t* data, size_t size) {
+    static const auto table = [] {
+        std::array<uint32_t, 256> values;
+
+        for (uint32_t i = 0; i < 256; i++) {
+            auto value = i;
+            for (auto bit = 0; bit < 8; bit++) {
+                value = (value & 1) ? 0xEDB88320u ^ (value >> 1) : value >> 1;
+            }
+
+            values[i] = value;
+        }
+
+        return values;
+    }();
+
+    auto crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+int paeth(int a, int b, int c) {
+    auto p = a + b - c;
+    auto pa = std::abs(p - a);
+    auto pb = std::abs(p - b);
+    auto pc = std::abs(p - c);
+
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+
+    return pb <= pc ? b : c;
+}
+
+// Both rows start with `bpp` zero bytes, so the left neighbours of the first pixel need no special casing. Bytes per
+// pixel is a template argument so the byte loops compile to fixed strides.
+template<size_t bpp>
+bool unfilterRow(uint8_t filter, uint8_t* row, const uint8_t* prev, size_t length) {
+    switch (filter) {
+        case 0:
+            break;
+
+        case 1:
+            for (auto i = bpp; i < length; i++) {
+                row[i] += row[i - bpp];
+            }
+            break;
+
+        case 2:
+            for (auto i = bpp; i < length; i++) {
+                row[i] += prev[i];
+            }
+            break;
+
+        case 3:
+            for (auto i = bpp; i < length; i++) {
+                row[i] += (row[i - bpp] + prev[i]) >> 1;
+            }
+            break;
+
+        case 4:
+            for (auto i = bpp; i < length; i++) {
+                row[i] += paeth(row[i - bpp], prev[i], prev[i - bpp]);
+            }
+            break;
+
+        default:
+            return false;
+    }
+
+    return true;
+}
+
+// Everything a row kernel needs besides the row, resolved once per image.
+struct MaskFormat {
+    uint32_t width;
+    uint8_t alphaThreshold;
+    // Opacity per palette index, or per grey value below 16 bits.
+    bool opaque[256];
+    uint16_t key[3];
+};
+
+// Packs `isOpaque(x)` of a whole row into mask words, 64 pixels per store.
+template<typename IsOpaque>
+void packRow(uint32_t width, uint64_t* outMask, IsOpaque&& isOpaque) {
+    for (uint32_t x0 = 0; x0 < width; x0 += 64) {
+        auto count = std::min(64u, width - x0);
+        uint64_t bits = 0;
+
+        for (auto i = 0u; i < count; i++) {
+            bits |= static_cast<uint64_t>(isOpaque(x0 + i)) << i;
+        }
+
+        outMask[x0 >> 6] = bits;
+    }
+}
+
+// Sample of a sub-byte pixel, most significant bits first.
+template<int BitDepth>
+uint32_t readPacked(const uint8_t* row, uint32_t x) {
+    if constexpr (BitDepth == 8) {
+        return row[x];
+    } else {
+        auto bit = x * BitDepth;
+        return (row[bit >> 3] >> (8 - BitDepth - (bit & 7))) & ((1u << BitDepth) - 1);
+    }
+}
+
+// Opacity bits of one unfiltered scanline, specialized per color type and bit depth so the inner loop neither branches
+// on the format nor converts pixels. 16-bit alpha is compared by its high byte, as lodepng's RGBA8 output would be.
+template<int ColorType, int BitDepth, bool bKey>
+void maskRow(const MaskFormat& format, const uint8_t* row, uint64_t* outMask) {
+    auto width = format.width;
+
+    if constexpr (ColorType == 6 || ColorType == 4) {
+        constexpr auto stride = (ColorType == 6 ? 4 : 2) * BitDepth / 8;
+        constexpr auto alphaOffset = stride - BitDepth / 8;
+        auto threshold = format.alphaThreshold;
+        packRow(width, outMask, [&](uint32_t x) { return row[x * stride + alphaOffset] > threshold; });
+    } else if constexpr (ColorType == 3) {
+        packRow(width, outMask, [&](uint32_t x) { return format.opaque[readPacked<BitDepth>(row, x)]; });
+    } else if constexpr (!bKey) {
+        // Grey or RGB without a transparent color: every pixel is opaque.
+        packRow(width, outMask, [](uint32_t) { return true; });
+    } else if constexpr (ColorType == 0 && BitDepth == 16) {
+        packRow(width, outMask, [&](uint32_t x) { return readUint16(row + x * 2) != format.key[0]; });
+    } else if constexpr (ColorType == 0) {
+        packRow(width, outMask, [&](uint32_t x) { return format.opaque[readPacked<BitDepth>(row, x)]; });
+    } else if constexpr (BitDepth == 16) {
+        packRow(width, outMask, [&](uint32_t x) {
+            auto pixel = row + x * 6;
+            return readUint16(pixel) != format.key[0] || readUint16(pixel + 2) != format.key[1] ||
+                readUint16(pixel + 4) != format.key[2];
+        });
+    } else {
+        packRow(width, outMask, [&](uint32_t x) {
+            auto pixel = row + x * 3;
+            return pixel[0] != format.key[0] || pixel[1] != format.key[1] || pixel[2] != format.key[2];
+        });
+    }
+}
+
+using MaskRowKernel = void (*)(const MaskFormat&, const uint8_t*, uint64_t*);
+using UnfilterKernel = bool (*)(uint8_t, uint8_t*, const uint8_t*, size_t);
+
+UnfilterKernel getUnfilterKernel(size_t bpp) {
+    switch (bpp) {
+        case 1: return unfilterRow<1>;
+        case 2: return unfilterRow<2>;
+        case 3: return unfilterRow<3>;
+        case 4: return unfilterRow<4>;
+        case 6: return unfilterRow<6>;
+        case 8: return unfilterRow<8>;
+    }
+
+    return nullptr;
+}
+
+// Picks the kernel for a validated header and fills the lookup tables it uses. Null when no pixel can be opaque.
+MaskRowKernel getMaskRowKernel(const Header& header, uint8_t alphaThreshold, MaskFormat& outFormat) {
+    // Alpha never exceeds 255, and transparent color keys map to 0 or 255.
+    if (alphaThreshold == 255) {
+        return nullptr;
+    }
+
+    outFormat.width = header.width;
+    outFormat.alphaThreshold = alphaThreshold;
+    std::copy(header.key, header.key + 3, outFormat.key);
+
+    for (auto i = 0; i < 256; i++) {
+        outFormat.opaque[i] = header.colorType == 3 ? header.paletteAlpha[i] > alphaThreshold : i != header.key[0];
+    }
+
+    if (!header.bKey && (header.colorType == 0 || header.colorType == 2)) {
+        return maskRow<0, 8, false>;
+    }
+
+    switch (header.colorType * 100 + header.bitDepth) {
+        case 1: return maskRow<0, 1, true>;
+        case 2: return maskRow<0, 2, true>;
+        case 4: return maskRow<0, 4, true>;
+        case 8: return maskRow<0, 8, true>;
+        case 16: return maskRow<0, 16, true>;
+        case 208: return maskRow<2, 8, true>;
+        case 216: return maskRow<2, 16, true>;
+        case 301: return maskRow<3, 1, false>;
+        case 302: return maskRow<3, 2, false>;
+        case 304: return maskRow<3, 4, false>;
+        case 308: return maskRow<3, 8, false>;
+        case 408: return maskRow<4, 8, false>;
+        case 416: return maskRow<4, 16, false>;
+        case 608: return maskRow<6, 8, false>;
+        case 616: return maskRow<6, 16, false>;
+    }
+
+    return nullptr;
+}
 
 bool png::read(const char* filePath, ImageData& image) {
     uint32_t width, height;
+    // lodepng appends to the vector, which still holds the previous pixels when the image is reused.
+    image.rawData.clear();
     auto error = lodepng::decode(image.rawData, width, height, filePath);
     if (error) {
         return false;
@@ -13,11 +282,181 @@ bool png::read(const char* filePath, ImageData& image) {
     return true;
 }
 
-bool png::write(const char* filePath, ImageData& image) {
-    auto error = lodepng::encode(filePath, image.rawData, image.width, image.height);
-    if (error) {
+bool png::write(const char* filePath, ImageData& image, Compression compression) {
+    return write(filePath, image.rawData, image.width, image.height, compression);
+}
+
+bool png::write(const char* filePath, const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height,
+    Compression compression) {
+
+    if (compression == Compression::Default) {
+        return lodepng::encode(filePath, pixels, width, height) == 0;
+    }
+
+    lodepng::State state;
+    state.encoder.auto_convert = 0;
+    state.encoder.filter_strategy = LFS_ZERO;
+    state.encoder.zlibsettings.windowsize = 512;
+    state.encoder.zlibsettings.nicematch = 16;
+    state.encoder.zlibsettings.lazymatching = 0;
+    state.info_png.color.colortype = LCT_RGBA;
+    state.info_png.color.bitdepth = 8;
+
+    std::vector<uint8_t> encoded;
+    if (lodepng::encode(encoded, pixels, width, height, state)) {
         return false;
     }
 
-    return true;
-}
\ No newline at end of file
+    return lodepng::save_file(encoded, filePath) == 0;
+}
+
+bool png::readMask(const char* filePath, ImageData& image, uint8_t alphaThreshold, bool bKeepPixels) {
+    io::FileData file;
+    if (!file.open(filePath)) {
+        return false;
+    }
+
+    return decodeMask(file.data(), file.size(), image, alphaThreshold, bKeepPixels);
+}
+
+bool decodeImageMask(const uint8_t* data, size_t size, ImageData& image, uint8_t alphaThreshold, bool bKeepPixels) {
+    if (size < 8 || std::memcmp(data, gSignature, 8) != 0) {
+        return false;
+    }
+
+    Header header;
+    std::memset(header.paletteAlpha, 255, sizeof(header.paletteAlpha));
+
+    // IDAT chunks are only copied together when the stream is split over several of them.
+    const uint8_t* compressed = nullptr;
+    size_t compressedSize = 0;
+    std::vector<uint8_t> joined;
+    auto bEnd = false;
+
+    for (size_t offset = 8; offset + 12 <= size;) {
+        auto length = readUint32(data + offset);
+        auto type = data + offset + 4;
+        auto chunk = data + offset + 8;
+
+        // Corrupt files are rejected like lodepng does, rather than turned into a wrong mask.
+        if (length > size - offset - 12 || getChunkCrc(type, length + 4) != readUint32(chunk + length)) {
+            return false;
+        }
+
+        if (std::memcmp(type, "IHDR", 4) == 0 && length == 13) {
+            header.width = readUint32(chunk);
+            header.height = readUint32(chunk + 4);
+            header.bitDepth = chunk[8];
+            header.colorType = chunk[9];
+            header.interlace = chunk[12];
+
+            if (!header.isValid() || chunk[10] != 0 || chunk[11] != 0) {
+                return false;
+            }
+        } else if (std::memcmp(type, "tRNS", 4) == 0) {
+            if (header.colorType == 3) {
+                std::memcpy(header.paletteAlpha, chunk, std::min<size_t>(length, 256));
+            } else if (header.colorType == 0 && length >= 2) {
+                header.key[0] = readUint16(chunk);
+                header.bKey = true;
+            } else if (header.colorType == 2 && length >= 6) {
+                header.key[0] = readUint16(chunk);
+                header.key[1] = readUint16(chunk + 2);
+                header.key[2] = readUint16(chunk + 4);
+                header.bKey = true;
+            }
+        } else if (std::memcmp(type, "IDAT", 4) == 0) {
+            if (compressed == nullptr) {
+                compressed = chunk;
+                compressedSize = length;
+            } else {
+                if (joined.empty()) {
+                    joined.assign(compressed, compressed + compressedSize);
+                }
+
+                joined.insert(joined.end(), chunk, chunk + length);
+                compressed = joined.data();
+                compressedSize = joined.size();
+            }
+        } else if (std::memcmp(type, "IEND", 4) == 0) {
+            bEnd = true;
+            break;
+        }
+
+        offset += length + 12;
+    }
+
+    // A file cut short after its image data still lacks IEND.
+    if (header.width == 0 || compressed == nullptr || !bEnd) {
+        return false;
+    }
+
+    // Interlaced passes don't map onto rows, and drawing needs the pixels anyway.
+    if (header.interlace != 0 || bKeepPixels) {
+        uint32_t width, height;
+        image.rawData.clear();
+        if (lodepng::decode(image.rawData, width, height, data, size)) {
+            return false;
+        }
+
+        image.width = static_cast<int>(width);
+        image.height = static_cast<int>(height);
+        image.buildOpacityMask(alphaThreshold);
+        return true;
+    }
+
+    image.rawData.clear();
+    image.width = static_cast<int>(header.width);
+    image.height = static_cast<int>(header.height);
+    image.resetOpacityMask();
+
+    auto bitsPerPixel = static_cast<size_t>(header.getChannels()) * header.bitDepth;
+    auto bpp = std::max<size_t>(1, bitsPerPixel / 8);
+    auto rowLength = (header.width * bitsPerPixel + 7) / 8;
+
+    auto unfilter = getUnfilterKernel(bpp);
+    if (unfilter == nullptr) {
+        return false;
+    }
+
+    MaskFormat format;
+    auto kernel = getMaskRowKernel(header, alphaThreshold, format);
+
+    // Row buffers per thread, the first file of a batch sizes them for most of the rest.
+    thread_local std::vector<uint8_t> current, previous;
+    current.assign(bpp + rowLength, 0);
+    previous.assign(bpp + rowLength, 0);
+
+    inflate::Stream stream(compressed, compressedSize);
+
+    for (auto y = 0; y < image.height; y++) {
+        uint8_t filter;
+        if (!stream.read(&filter, 1) || !stream.read(current.data() + bpp, rowLength)) {
+            return false;
+        }
+
+        if (!unfilter(filter, current.data(), previous.data(), current.size())) {
+            return false;
+        }
+
+        // The rows are still inflated without a kernel, so broken files fail the same way.
+        if (kernel) {
+            kernel(format, current.data() + bpp, image.getOpacityMaskRow(y));
+        }
+
+        current.swap(previous);
+    }
+
+    return stream.finish();
+}
+
+bool png::decodeMask(const uint8_t* data, size_t size, ImageData& image, uint8_t alphaThreshold, bool bKeepPixels) {
+    // A header within the limits can still ask for more than is left, in a worker that's a failed file too.
+    try {
+        return decodeImageMask(data, size, image, alphaThreshold, bKeepPixels);
+    } catch (const std::bad_alloc&) {
+        return false;
+    } catch (const std::length_error&) {
+        return false;
+    }
+}
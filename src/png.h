@@ -4,6 +4,21 @@
 #include "ImageData.h"
 
 namespace png {
+    // Default is lodepng's own setting. Fast skips the filter search and color reduction and only looks for short
+    // matches, for debug output that is written often and looked at rarely.
+    enum class Compression {
+        Default,
+        Fast
+    };
+
     bool read(const char* filePath, ImageData& image);
-    bool write(const char* filePath, ImageData& image);
-}
\ No newline at end of file
+    bool write(const char* filePath, ImageData& image, Compression compression = Compression::Default);
+    // Tightly packed RGBA rows.
+    bool write(const char* filePath, const std::vector<uint8_t>& pixels, uint32_t width, uint32_t height,
+        Compression compression = Compression::Default);
+
+    // Decodes straight into the opacity mask, one scanline at a time, without keeping the RGBA pixels. With
+    // `bKeepPixels` (or for interlaced files) the whole image is decoded as usual and the mask is built from it.
+    bool readMask(const char* filePath, ImageData& image, uint8_t alphaThreshold, bool bKeepPixels);
+    bool decodeMask(const uint8_t* data, size_t size, ImageData& image, uint8_t alphaThreshold, bool bKeepPixels);
+}
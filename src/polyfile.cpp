@@ -0,0 +1,61 @@
+#include "polyfile.h"
+
+void polyfile::Writer::addFile(std::string_view path, uint32_t flags) {
+    FileRecord file {};
+    file.pathOffset = static_cast<uint32_t>(strings.size());
+    file.pathLength = static_cast<uint32_t>(path.size());
+    file.firstShape = static_cast<uint32_t>(shapes.size());
+    file.flags = flags;
+
+    files.push_back(file);
+    strings.append(path);
+}
+
+void polyfile::Writer::addShape(int32_t x, int32_t y, int32_t width, int32_t height, const float* xy,
+    uint32_t vertexCount, float area) {
+
+    ShapeRecord shape {};
+    shape.x = x;
+    shape.y = y;
+    shape.width = width;
+    shape.height = height;
+    shape.firstVertex = static_cast<uint32_t>(vertices.size() / 2);
+    shape.vertexCount = vertexCount;
+    shape.area = area;
+
+    shapes.push_back(shape);
+    vertices.insert(vertices.end(), xy, xy + vertexCount * 2);
+    files.back().shapeCount++;
+}
+
+bool polyfile::Writer::serialize(std::string& out) const {
+    // Every count and offset is at most the total size, so checking that covers the casts below and in addFile and
+    // addShape.
+    auto totalSize = sizeof(Header) + files.size() * sizeof(FileRecord) + shapes.size() * sizeof(ShapeRecord) +
+        vertices.size() * sizeof(float) + strings.size();
+    if (totalSize > UINT32_MAX) {
+        return false;
+    }
+
+    Header header {};
+    std::memcpy(header.magic, gMagic, 4);
+    header.version = gVersion;
+    header.fileCount = static_cast<uint32_t>(files.size());
+    header.shapeCount = static_cast<uint32_t>(shapes.size());
+    header.vertexCount = static_cast<uint32_t>(vertices.size() / 2);
+    header.stringTableSize = static_cast<uint32_t>(strings.size());
+    header.fileTableOffset = sizeof(Header);
+    header.shapeTableOffset = header.fileTableOffset + header.fileCount * sizeof(FileRecord);
+    header.vertexOffset = header.shapeTableOffset + header.shapeCount * sizeof(ShapeRecord);
+    header.stringTableOffset = header.vertexOffset + header.vertexCount * sizeof(float) * 2;
+
+    out.clear();
+    out.reserve(totalSize);
+    out.append(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.append(reinterpret_cast<const char*>(files.data()), files.size() * sizeof(FileRecord));
+    out.append(reinterpret_cast<const char*>(shapes.data()), shapes.size() * sizeof(ShapeRecord));
+    out.append(reinterpret_cast<const char*>(vertices.data()), vertices.size() * sizeof(float));
+    out.append(strings);
+
+    return true;
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+// Binary polygon output, as written by `--format bin`. The reader is header only and needs nothing but the standard
+// library, so this file can be copied into the projects loading the output; only the writer lives in polyfile.cpp.
+//
+// Layout, all values little-endian and every section 4-byte aligned:
+//   Header
+//   FileRecord[fileCount]
+//   ShapeRecord[shapeCount]
+//   float[vertexCount * 2]      x, y pairs; each shape's vertices are contiguous
+//   char[stringTableSize]       file paths, not null terminated
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <bit>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define POLYFILE_MMAP
+#endif
+
+namespace polyfile {
+    static_assert(std::endian::native == std::endian::little, "polyfile is only implemented for little-endian hosts");
+
+    const char gMagic[4] { 'S', 'P', 'L', 'Y' };
+    const uint32_t gVersion = 1;
+
+    struct Header {
+        char magic[4];
+        uint32_t version;
+        uint32_t fileCount;
+        uint32_t shapeCount;
+        uint32_t vertexCount;
+        uint32_t stringTableSize;
+        uint32_t fileTableOffset;
+        uint32_t shapeTableOffset;
+        uint32_t vertexOffset;
+        uint32_t stringTableOffset;
+    };
+
+    enum FileFlags : uint32_t {
+        // The analysis reported an error, e.g. the image couldn't be read. Such files have no shapes.
+        FileError = 1 << 0
+    };
+
+    struct FileRecord {
+        uint32_t pathOffset;
+        uint32_t pathLength;
+        uint32_t firstShape;
+        uint32_t shapeCount;
+        uint32_t flags;
+    };
+
+    struct ShapeRecord {
+        int32_t x;
+        int32_t y;
+        int32_t width;
+        int32_t height;
+        // Zero vertices when no enclosing polygon was found.
+        uint32_t firstVertex;
+        uint32_t vertexCount;
+        float area;
+    };
+
+    static_assert(sizeof(Header) == 40 && sizeof(FileRecord) == 20 && sizeof(ShapeRecord) == 28);
+
+    // Indexes a file in place. Opening validates every table and range once, after that all accessors are plain
+    // pointer arithmetic and nothing is allocated or copied.
+    class Reader {
+    private:
+        const uint8_t* data = nullptr;
+        size_t size = 0;
+        size_t mappedSize = 0;
+        const Header* header = nullptr;
+        const FileRecord* files = nullptr;
+        const ShapeRecord* shapes = nullptr;
+        const float* vertices = nullptr;
+        const char* strings = nullptr;
+
+    public:
+        Reader() = default;
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        ~Reader() {
+            close();
+        }
+
+        // Uses a buffer owned by the caller, which has to stay alive and be at least 4-byte aligned.
+        bool open(const void* buffer, size_t length) {
+            close();
+
+            data = static_cast<const uint8_t*>(buffer);
+            size = length;
+
+            if (!validate()) {
+                close();
+                return false;
+            }
+
+            return true;
+        }
+
+        bool map(const char* filePath) {
+#ifdef POLYFILE_MMAP
+            close();
+
+            auto fd = ::open(filePath, O_RDONLY);
+            if (fd < 0) {
+                return false;
+            }
+
+            struct stat info;
+            if (fstat(fd, &info) != 0 || info.st_size < static_cast<off_t>(sizeof(Header))) {
+                ::close(fd);
+                return false;
+            }
+
+            auto length = static_cast<size_t>(info.st_size);
+            auto address = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+
+            if (address == MAP_FAILED) {
+                return false;
+            }
+
+            if (!open(address, length)) {
+                munmap(address, length);
+                return false;
+            }
+
+            mappedSize = length;
+            return true;
+#else
+            (void) filePath;
+            return false;
+#endif
+        }
+
+        void close() {
+#ifdef POLYFILE_MMAP
+            if (mappedSize > 0) {
+                munmap(const_cast<uint8_t*>(data), mappedSize);
+            }
+#endif
+            data = nullptr;
+            size = 0;
+            mappedSize = 0;
+            header = nullptr;
+        }
+
+        bool isOpen() const {
+            return header != nullptr;
+        }
+
+        uint32_t getFileCount() const {
+            return header->fileCount;
+        }
+
+        uint32_t getShapeCount() const {
+            return header->shapeCount;
+        }
+
+        const FileRecord& getFile(uint32_t index) const {
+            return files[index];
+        }
+
+        const ShapeRecord& getShape(uint32_t index) const {
+            return shapes[index];
+        }
+
+        std::string_view getPath(const FileRecord& file) const {
+            return { strings + file.pathOffset, file.pathLength };
+        }
+
+        const ShapeRecord* getShapes(const FileRecord& file) const {
+            return shapes + file.firstShape;
+        }
+
+        // `vertexCount` x, y pairs.
+        const float* getVertices(const ShapeRecord& shape) const {
+            return vertices + static_cast<size_t>(shape.firstVertex) * 2;
+        }
+
+    private:
+        bool isInside(uint64_t offset, uint64_t count, uint64_t itemSize) const {
+            return offset % 4 == 0 && offset + count * itemSize <= size;
+        }
+
+        bool validate() {
+            if (size < sizeof(Header) || reinterpret_cast<uintptr_t>(data) % 4 != 0) {
+                return false;
+            }
+
+            auto h = reinterpret_cast<const Header*>(data);
+            if (std::memcmp(h->magic, gMagic, 4) != 0 || h->version != gVersion ||
+                !isInside(h->fileTableOffset, h->fileCount, sizeof(FileRecord)) ||
+                !isInside(h->shapeTableOffset, h->shapeCount, sizeof(ShapeRecord)) ||
+                !isInside(h->vertexOffset, h->vertexCount, sizeof(float) * 2) ||
+                !isInside(h->stringTableOffset, h->stringTableSize, 1)) {
+                return false;
+            }
+
+            files = reinterpret_cast<const FileRecord*>(data + h->fileTableOffset);
+            shapes = reinterpret_cast<const ShapeRecord*>(data + h->shapeTableOffset);
+            vertices = reinterpret_cast<const float*>(data + h->vertexOffset);
+            strings = reinterpret_cast<const char*>(data + h->stringTableOffset);
+
+            for (auto i = 0u; i < h->fileCount; i++) {
+                auto& file = files[i];
+                if (uint64_t(file.pathOffset) + file.pathLength > h->stringTableSize ||
+                    uint64_t(file.firstShape) + file.shapeCount > h->shapeCount) {
+                    return false;
+                }
+            }
+
+            for (auto i = 0u; i < h->shapeCount; i++) {
+                auto& shape = shapes[i];
+                if (uint64_t(shape.firstVertex) + shape.vertexCount > h->vertexCount) {
+                    return false;
+                }
+            }
+
+            header = h;
+            return true;
+        }
+    };
+
+    // Collects results in memory and serializes them in one go.
+    class Writer {
+    private:
+        std::vector<FileRecord> files;
+        std::vector<ShapeRecord> shapes;
+        std::vector<float> vertices;
+        std::string strings;
+
+    public:
+        // Shapes added afterwards belong to this file.
+        void addFile(std::string_view path, uint32_t flags = 0);
+        void addShape(int32_t x, int32_t y, int32_t width, int32_t height, const float* xy, uint32_t vertexCount,
+            float area);
+
+        // False when the output would be larger than the 32-bit offsets can address.
+        bool serialize(std::string& out) const;
+    };
+}
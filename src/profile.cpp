@@ -0,0 +1,181 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include "profile.h"
+#include "util.h"
+
+struct ProfileEvent {
+    const char* stage;
+    uint32_t file;
+    uint32_t shape;
+    uint64_t begin;
+    uint64_t end;
+    uint64_t allocations;
+};
+
+// Events of one thread. Only that thread appends to it, so recording doesn't take a lock.
+struct ProfileBuffer {
+    uint32_t thread;
+    std::vector<ProfileEvent> events;
+};
+
+std::atomic<bool> profile::gEnabled { false };
+thread_local uint64_t profile::gThreadAllocations = 0;
+
+std::chrono::steady_clock::time_point gProfileStart;
+std::mutex gProfileMutex;
+// Owned here rather than by the threads, so the events outlive threads that finished early.
+std::vector<std::unique_ptr<ProfileBuffer>> gProfileBuffers;
+std::vector<std::string> gProfileFiles;
+std::unordered_map<std::string, uint32_t> gProfileFileIndices;
+
+thread_local ProfileBuffer* gThreadProfileBuffer = nullptr;
+
+void profile::enable() {
+    gProfileStart = std::chrono::steady_clock::now();
+    gEnabled.store(true);
+}
+
+uint32_t profile::addFile(const std::string& filePath) {
+    if (!isEnabled()) {
+        return gNone;
+    }
+
+    std::lock_guard lock(gProfileMutex);
+
+    auto [it, bAdded] = gProfileFileIndices.try_emplace(filePath, static_cast<uint32_t>(gProfileFiles.size()));
+    if (bAdded) {
+        gProfileFiles.push_back(filePath);
+    }
+
+    return it->second;
+}
+
+uint64_t profile::now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - gProfileStart)
+        .count();
+}
+
+void profile::record(const char* stage, uint32_t file, uint32_t shape, uint64_t begin, uint64_t end,
+    uint64_t allocations) {
+
+    // The profiler's own allocations aren't attributed to any span.
+    auto threadAllocations = gThreadAllocations;
+
+    if (!gThreadProfileBuffer) {
+        std::lock_guard lock(gProfileMutex);
+
+        gProfileBuffers.push_back(std::make_unique<ProfileBuffer>());
+        gThreadProfileBuffer = gProfileBuffers.back().get();
+        gThreadProfileBuffer->thread = static_cast<uint32_t>(gProfileBuffers.size() - 1);
+        gThreadProfileBuffer->events.reserve(4096);
+    }
+
+    gThreadProfileBuffer->events.push_back({ stage, file, shape, begin, end, allocations });
+    gThreadAllocations = threadAllocations;
+}
+
+void writeJsonString(std::ostream& stream, const std::string& value) {
+    stream << '"';
+
+    for (auto c : value) {
+        if (c == '"' || c == '\\') {
+            stream << '\\' << c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            stream << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c) << std::dec;
+        } else {
+            stream << c;
+        }
+    }
+
+    stream << '"';
+}
+
+bool profile::writeTrace(const char* filePath) {
+    std::ofstream stream(filePath, std::ios::binary);
+    if (!stream) {
+        return false;
+    }
+
+    // Complete ("X") events in microseconds, plus a name per thread.
+    stream << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    stream << std::fixed << std::setprecision(3);
+
+    auto bFirst = true;
+
+    for (auto& buffer : gProfileBuffers) {
+        stream << (bFirst ? "" : ",") << "\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":"
+            << buffer->thread << ",\"args\":{\"name\":\"thread " << buffer->thread << "\"}}";
+        bFirst = false;
+
+        for (auto& event : buffer->events) {
+            stream << ",\n{\"name\":\"" << event.stage << "\",\"cat\":\"stage\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << buffer->thread << ",\"ts\":" << event.begin / 1e3 << ",\"dur\":"
+                << (event.end - event.begin) / 1e3 << ",\"args\":{\"allocations\":" << event.allocations;
+
+            if (event.file != gNone) {
+                stream << ",\"file\":";
+                writeJsonString(stream, gProfileFiles[event.file]);
+            }
+
+            if (event.shape != gNone) {
+                stream << ",\"shape\":" << event.shape;
+            }
+
+            stream << "}}";
+        }
+    }
+
+    stream << "\n]}\n";
+
+    return static_cast<bool>(stream);
+}
+
+void profile::printSummary() {
+    std::map<std::string, std::vector<uint64_t>> durations;
+    std::map<std::string, uint64_t> allocations;
+
+    for (auto& buffer : gProfileBuffers) {
+        for (auto& event : buffer->events) {
+            durations[event.stage].push_back(event.end - event.begin);
+            allocations[event.stage] += event.allocations;
+        }
+    }
+
+    // Nearest rank on sorted durations, in milliseconds.
+    auto getPercentile = [](const std::vector<uint64_t>& sorted, double percentile) {
+        auto rank = static_cast<size_t>(std::ceil(percentile * sorted.size()));
+        return sorted[std::max<size_t>(rank, 1) - 1] / 1e6;
+    };
+
+    std::ostringstream table;
+    table << std::left << std::setw(20) << "stage" << std::right << std::setw(10) << "count" << std::setw(12)
+        << "total ms" << std::setw(10) << "p50 ms" << std::setw(10) << "p99 ms" << std::setw(10) << "max ms"
+        << std::setw(12) << "allocs";
+    table << std::fixed << std::setprecision(3);
+
+    for (auto& [stage, values] : durations) {
+        std::sort(values.begin(), values.end());
+
+        uint64_t total = 0;
+        for (auto value : values) {
+            total += value;
+        }
+
+        table << '\n' << std::left << std::setw(20) << stage << std::right << std::setw(10) << values.size()
+            << std::setw(12) << total / 1e6 << std::setw(10) << getPercentile(values, 0.5) << std::setw(10)
+            << getPercentile(values, 0.99) << std::setw(10) << values.back() / 1e6 << std::setw(12)
+            << allocations[stage];
+    }
+
+    // Standard output carries the results.
+    util::printError(table.str());
+}
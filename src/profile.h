@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// Scoped timing spans per thread, written as a Chrome trace (chrome://tracing, Perfetto) and summarized per stage.
+// Nothing is recorded unless profiling was enabled; a disabled Scope costs one relaxed load.
+namespace profile {
+    const uint32_t gNone = UINT32_MAX;
+
+    extern std::atomic<bool> gEnabled;
+
+    // Heap allocations made by the current thread. Only counted when the executable's replacement operator new
+    // increments it, otherwise spans report no allocations.
+    extern thread_local uint64_t gThreadAllocations;
+
+    void enable();
+
+    inline bool isEnabled() {
+        return gEnabled.load(std::memory_order_relaxed);
+    }
+
+    // Index of a file path for spans, so events don't have to carry strings. gNone when profiling is off.
+    uint32_t addFile(const std::string& filePath);
+
+    // Nanoseconds since profiling was enabled.
+    uint64_t now();
+
+    void record(const char* stage, uint32_t file, uint32_t shape, uint64_t begin, uint64_t end,
+        uint64_t allocations);
+
+    // Records its lifetime as a span of `stage`, which has to be a string literal.
+    class Scope {
+    private:
+        const char* stage;
+        uint32_t file;
+        uint32_t shape;
+        uint64_t begin;
+        uint64_t allocations;
+
+    public:
+        explicit Scope(const char* stage, uint32_t file = gNone, uint32_t shape = gNone)
+            :stage(isEnabled() ? stage : nullptr), file(file), shape(shape), begin(this->stage ? now() : 0),
+            allocations(this->stage ? gThreadAllocations : 0) {
+        }
+
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+        ~Scope() {
+            if (stage) {
+                record(stage, file, shape, begin, now(), gThreadAllocations - allocations);
+            }
+        }
+    };
+
+    // Both must only be called once nothing is being recorded anymore.
+    bool writeTrace(const char* filePath);
+    void printSummary();
+}
@@ -1,5 +1,8 @@
 #include "util.h"
 
+const size_t gLineWriterBufferSize = 1 << 16;
+const auto gLineWriterInterval = std::chrono::milliseconds(100);
+
 void util::bail(const char* message, int code) {
     if (code > 0) {
         printError(message);
@@ -9,3 +12,65 @@ void util::bail(const char* message, int code) {
 
     exit(code);
 }
+
+util::LineWriter::LineWriter(std::ostream& stream) : stream(stream) {}
+
+util::LineWriter::~LineWriter() {
+    {
+        std::lock_guard lock(mutex);
+        bStopping = true;
+    }
+
+    condition.notify_one();
+    if (flusher.joinable()) {
+        flusher.join();
+    }
+
+    flush();
+}
+
+void util::LineWriter::write(const std::string& line) {
+    std::lock_guard lock(mutex);
+
+    if (!flusher.joinable()) {
+        flusher = std::thread(&LineWriter::runFlusher, this);
+    }
+
+    auto bWasEmpty = buffer.empty();
+    buffer += line;
+    buffer += '\n';
+
+    if (buffer.size() >= gLineWriterBufferSize) {
+        flushLocked();
+    } else if (bWasEmpty) {
+        condition.notify_one();
+    }
+}
+
+void util::LineWriter::runFlusher() {
+    std::unique_lock lock(mutex);
+
+    while (true) {
+        condition.wait(lock, [this] { return bStopping || !buffer.empty(); });
+        if (bStopping) {
+            return;
+        }
+
+        // Lines arriving meanwhile go out in the same block.
+        condition.wait_for(lock, gLineWriterInterval, [this] { return bStopping; });
+        flushLocked();
+    }
+}
+
+void util::LineWriter::flush() {
+    std::lock_guard lock(mutex);
+    flushLocked();
+}
+
+void util::LineWriter::flushLocked() {
+    if (!buffer.empty()) {
+        stream.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        stream.flush();
+        buffer.clear();
+    }
+}
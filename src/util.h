@@ -1,6 +1,13 @@
 #pragma once
 
 #include <iostream>
+#include <string>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <chrono>
+#include <memory>
+#include <vector>
 
 namespace util {
     template<typename ...Args>
@@ -14,4 +21,57 @@ namespace util {
     }
 
     void bail(const char* message, int code = 1);
+
+    // Collects lines from any thread and writes them to a stream, stdout by default, in large blocks. Pending output is
+    // flushed once the buffer fills up, by a background thread at most 100ms after a line arrives, and on destruction.
+    class LineWriter {
+    private:
+        std::ostream& stream;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::string buffer;
+        bool bStopping = false;
+        // Started with the first line.
+        std::thread flusher;
+
+    public:
+        explicit LineWriter(std::ostream& stream = std::cout);
+        ~LineWriter();
+
+        void write(const std::string& line);
+        void flush();
+
+    private:
+        void runFlusher();
+        void flushLocked();
+    };
+
+    // Objects handed back and forth between tasks, so their buffers are reused instead of allocated per use. A flow can
+    // move between threads, which is why this is a shared free list rather than per thread storage. Whoever acquires
+    // an object resets what it needs.
+    template<typename T>
+    class Pool {
+    private:
+        std::mutex mutex;
+        std::vector<std::unique_ptr<T>> objects;
+
+    public:
+        std::unique_ptr<T> acquire() {
+            {
+                std::lock_guard lock(mutex);
+                if (!objects.empty()) {
+                    auto object = std::move(objects.back());
+                    objects.pop_back();
+                    return object;
+                }
+            }
+
+            return std::make_unique<T>();
+        }
+
+        void release(std::unique_ptr<T> object) {
+            std::lock_guard lock(mutex);
+            objects.push_back(std::move(object));
+        }
+    };
 }
\ No newline at end of file